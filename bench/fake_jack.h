@@ -0,0 +1,94 @@
+/*
+ * a fake JACK: a cycle driver without jitter, and a MIDI port buffer of
+ * fixed size, which also measures how far from its ideal time every
+ * event is placed
+ */
+#ifndef FAKE_JACK_H
+#define FAKE_JACK_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../src/midi_queue.h"
+#include "../src/latency_histogram.h"
+
+// what JACK2 gives a MIDI port by default
+#define FAKE_PORT_SIZE (32 * 1024)
+
+typedef struct {
+    uint32_t nframes;
+    uint32_t sample_rate;
+    double period;
+    uint64_t start;
+    // cycles run so far
+    unsigned long cycles;
+} fake_jack_t;
+
+inline void fake_jack_init(fake_jack_t& jack, uint32_t nframes, uint32_t sample_rate, uint64_t start)
+{
+    jack.nframes     = nframes;
+    jack.sample_rate = sample_rate;
+    jack.period      = 1000000.0 * nframes / sample_rate;
+    jack.start       = start;
+    jack.cycles      = 0;
+}
+
+// start of the cycle about to run
+inline uint64_t fake_jack_cycle_start(fake_jack_t& jack)
+{
+    return jack.start + (uint64_t)((jack.cycles + 1) * jack.period);
+}
+
+// output type of pickup_from_queue()
+struct fake_port_t {
+    uint8_t data[FAKE_PORT_SIZE];
+    size_t used;
+    unsigned long events;
+
+    // to measure the placement of the message being reserved for
+    fake_jack_t *jack;
+    midi_queue_t *queue;
+    // usecs between the time an event plays and one period after its USB completion
+    latency_histogram_t placement_error;
+
+    void clear()
+    {
+        used = 0;
+    }
+
+    size_t max_event_size()
+    {
+        return FAKE_PORT_SIZE - used;
+    }
+
+    uint8_t *reserve(uint32_t frame, size_t size)
+    {
+        if (size > FAKE_PORT_SIZE - used) {
+            return NULL;
+        }
+
+        midi_message_t& msg = queue->events.front();
+        uint64_t plays = fake_jack_cycle_start(*jack) + (uint64_t)(frame * jack->period / jack->nframes);
+        int64_t error  = (int64_t)(plays - msg.time) - (int64_t)jack->period;
+        latency_record(placement_error, error < 0 ? -error : error);
+
+        uint8_t *buffer = data + used;
+        used += size;
+        events++;
+        return buffer;
+    }
+};
+
+// one process() cycle: everything queued goes into port
+inline void fake_jack_cycle(fake_jack_t& jack, fake_port_t& port, midi_queue_t& queue)
+{
+    uint64_t prev_cycle = jack.start + (uint64_t)(jack.cycles * jack.period);
+
+    port.jack  = &jack;
+    port.queue = &queue;
+    port.clear();
+    pickup_from_queue(queue, port, prev_cycle, jack.period, jack.nframes);
+    jack.cycles++;
+}
+
+#endif
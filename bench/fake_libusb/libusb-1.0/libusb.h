@@ -0,0 +1,95 @@
+/*
+ * a fake libusb: just enough of it for src/transfer_pool.h, so that the
+ * benchmarks run the real OUT path without a device
+ *
+ * A submitted transfer is only counted and kept, fake_libusb_complete()
+ * completes all of them, like the device taking them in one go.
+ */
+#ifndef FAKE_LIBUSB_H
+#define FAKE_LIBUSB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define LIBUSB_ENDPOINT_IN  0x80
+#define LIBUSB_ENDPOINT_OUT 0x00
+
+typedef struct libusb_device libusb_device;
+typedef struct libusb_device_handle libusb_device_handle;
+
+struct libusb_transfer;
+typedef void (*libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+
+struct libusb_transfer {
+    libusb_device_handle *dev_handle;
+    unsigned char endpoint;
+    unsigned int timeout;
+    int length;
+    int actual_length;
+    libusb_transfer_cb_fn callback;
+    void *user_data;
+    unsigned char *buffer;
+};
+
+// what libusb_get_max_packet_size() says about every endpoint
+static int fake_libusb_max_packet_size = 32;
+
+// submitted and not completed yet
+#define FAKE_LIBUSB_IN_FLIGHT 256
+static struct libusb_transfer *fake_libusb_in_flight[FAKE_LIBUSB_IN_FLIGHT];
+static int fake_libusb_in_flight_count;
+
+inline struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+    return (struct libusb_transfer *)calloc(1, sizeof(struct libusb_transfer));
+}
+
+inline void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    free(transfer);
+}
+
+inline void libusb_fill_interrupt_transfer(struct libusb_transfer *transfer, libusb_device_handle *devh,
+                                           unsigned char endpoint, unsigned char *buffer, int length,
+                                           libusb_transfer_cb_fn callback, void *user_data, unsigned int timeout)
+{
+    transfer->dev_handle = devh;
+    transfer->endpoint   = endpoint;
+    transfer->buffer     = buffer;
+    transfer->length     = length;
+    transfer->callback   = callback;
+    transfer->user_data  = user_data;
+    transfer->timeout    = timeout;
+}
+
+inline libusb_device *libusb_get_device(libusb_device_handle *devh)
+{
+    return NULL;
+}
+
+inline int libusb_get_max_packet_size(libusb_device *device, unsigned char endpoint)
+{
+    return fake_libusb_max_packet_size;
+}
+
+inline int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    if (fake_libusb_in_flight_count == FAKE_LIBUSB_IN_FLIGHT) {
+        return -1;
+    }
+    fake_libusb_in_flight[fake_libusb_in_flight_count++] = transfer;
+    return 0;
+}
+
+// runs the callback of every transfer in flight
+inline void fake_libusb_complete()
+{
+    for (int i = 0; i < fake_libusb_in_flight_count; i++) {
+        struct libusb_transfer *transfer = fake_libusb_in_flight[i];
+        transfer->actual_length = transfer->length;
+        transfer->callback(transfer);
+    }
+    fake_libusb_in_flight_count = 0;
+}
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * a fake USB device, which replays captured IN payloads at their
+ * recorded completion times through process_incoming()
+ *
+ * A capture is a text file with one transfer per line: the completion
+ * time in usecs, then the payload bytes in hex, for example
+ *
+ *   1000 90 3c 64
+ *   1250 80 3c 00 b0 01 40
+ *
+ * By default a payload completes at its recorded time. fake_usb_transfers()
+ * models the IN transfers of the driver instead: the host polls the
+ * endpoint once per interval, a payload only completes into a pending
+ * transfer, together with whatever else was ready and fits in it, and the USB thread runs the callback after a wakeup delay,
+ * now and then a long one, before it submits the transfer again. With
+ * one transfer, whatever the keyboard sends meanwhile waits in it.
+ */
+#ifndef FAKE_USB_H
+#define FAKE_USB_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/midi_queue.h"
+
+// like the IN transfers of the real device
+#define FAKE_USB_PACKET_SIZE 32
+// like MAX_IN_TRANSFERS of the driver
+#define FAKE_USB_MAX_TRANSFERS 8
+
+typedef struct {
+    uint64_t time;
+    int length;
+    uint8_t buffer[FAKE_USB_PACKET_SIZE];
+} fake_usb_packet_t;
+
+typedef struct {
+    fake_usb_packet_t *packets;
+    int count;
+    int capacity;
+    // replay position, and what is added to the recorded times
+    int next;
+    uint64_t offset;
+
+    // IN transfers in flight, 0 completes every payload at its recorded time
+    int transfers;
+    // usecs: between two polls of the host, from a completion until the
+    // USB thread runs when it was asleep, the longest of the stalls one
+    // wakeup in 100 gets on top, and the callback itself
+    uint64_t interval;
+    uint64_t wake;
+    uint64_t stall;
+    uint64_t callback_cost;
+
+    // when each transfer is pending again, in submission order from head
+    uint64_t pending_at[FAKE_USB_MAX_TRANSFERS];
+    int head;
+    uint64_t last_poll;
+    // the transfer completed last, which takes more while it has room
+    uint64_t last_completion;
+    int last_fill;
+    uint64_t thread_free;
+    uint32_t random_state;
+    // callback time of the payload at next, once known
+    uint64_t next_time;
+    bool next_known;
+
+    // statistics: recorded time to callback, the longest wait of a payload
+    // for a pending transfer, and the bytes between first and last
+    latency_histogram_t wait;
+    uint64_t max_starved;
+    uint64_t first_ready;
+    uint64_t last_callback;
+    unsigned long bytes;
+} fake_usb_t;
+
+inline bool fake_usb_init(fake_usb_t& usb, int capacity)
+{
+    usb.packets   = (fake_usb_packet_t *)calloc(capacity, sizeof(fake_usb_packet_t));
+    usb.capacity  = capacity;
+    usb.count     = 0;
+    usb.next      = 0;
+    usb.offset    = 0;
+    usb.transfers = 0;
+    return usb.packets != NULL;
+}
+
+inline void fake_usb_free(fake_usb_t& usb)
+{
+    free(usb.packets);
+    usb.packets = NULL;
+}
+
+// longer payloads are split into several transfers completing at the same time
+inline bool fake_usb_add(fake_usb_t& usb, uint64_t time, const uint8_t *buffer, int length)
+{
+    while (length > 0) {
+        if (usb.count == usb.capacity) {
+            return false;
+        }
+
+        fake_usb_packet_t& packet = usb.packets[usb.count++];
+        packet.time   = time;
+        packet.length = length < FAKE_USB_PACKET_SIZE ? length : FAKE_USB_PACKET_SIZE;
+        memcpy(packet.buffer, buffer, packet.length);
+        buffer += packet.length;
+        length -= packet.length;
+    }
+
+    return true;
+}
+
+inline bool fake_usb_load(fake_usb_t& usb, const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        perror(filename);
+        return false;
+    }
+
+    char line[1024];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+
+        char *p = line;
+        char *end;
+        unsigned long long time = strtoull(p, &end, 10);
+        if (end == p) {
+            continue;
+        }
+
+        uint8_t buffer[FAKE_USB_PACKET_SIZE];
+        int length = 0;
+        for (p = end; length < FAKE_USB_PACKET_SIZE; p = end) {
+            unsigned long byte = strtoul(p, &end, 16);
+            if (end == p) {
+                break;
+            }
+            buffer[length++] = byte;
+        }
+
+        if (!fake_usb_add(usb, time, buffer, length)) {
+            fprintf(stderr, "%s:%d: too many transfers\n", filename, line_number);
+            fclose(file);
+            return false;
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+// length of the capture
+inline uint64_t fake_usb_duration(fake_usb_t& usb)
+{
+    return usb.count ? usb.packets[usb.count - 1].time - usb.packets[0].time : 0;
+}
+
+// start over, the recorded times shifted by offset
+inline void fake_usb_rewind(fake_usb_t& usb, uint64_t offset)
+{
+    usb.next       = 0;
+    usb.offset     = offset;
+    usb.next_known = false;
+}
+
+// model count IN transfers in flight, see the top of this file
+inline void fake_usb_transfers(fake_usb_t& usb, int count, uint64_t interval, uint64_t wake, uint64_t stall)
+{
+    usb.transfers       = count < 1 ? 1 : count > FAKE_USB_MAX_TRANSFERS ? FAKE_USB_MAX_TRANSFERS : count;
+    usb.interval        = interval ? interval : 1;
+    usb.wake            = wake;
+    usb.stall           = stall;
+    usb.callback_cost   = 10;
+    usb.random_state    = 1;
+    memset(usb.pending_at, 0, sizeof(usb.pending_at));
+    usb.head            = 0;
+    usb.last_poll       = 0;
+    usb.last_completion = 0;
+    usb.last_fill       = 0;
+    usb.thread_free     = 0;
+    usb.next_known      = false;
+    usb.max_starved     = 0;
+    usb.first_ready     = 0;
+    usb.last_callback   = 0;
+    usb.bytes           = 0;
+}
+
+// 0 to 65535, like random_below() of the bench
+inline uint32_t fake_usb_random(fake_usb_t& usb)
+{
+    usb.random_state = usb.random_state * 1103515245 + 12345;
+    return usb.random_state >> 16;
+}
+
+// when the callback of a payload that is ready at ready runs; its transfer is submitted again after it
+inline uint64_t fake_usb_complete(fake_usb_t& usb, uint64_t ready, int length)
+{
+    // what was ready at the last poll went out with it, as far as it fits
+    if (usb.bytes && ready <= usb.last_poll && usb.last_fill + length <= FAKE_USB_PACKET_SIZE) {
+        usb.last_fill += length;
+        usb.bytes += length;
+        latency_record(usb.wait, usb.last_completion - ready);
+        return usb.last_completion;
+    }
+
+    // the next poll which finds the oldest transfer pending
+    uint64_t poll = ready;
+    if (usb.pending_at[usb.head] > poll) {
+        if (usb.pending_at[usb.head] - ready > usb.max_starved) {
+            usb.max_starved = usb.pending_at[usb.head] - ready;
+        }
+        poll = usb.pending_at[usb.head];
+    }
+    if (usb.last_poll && usb.last_poll + usb.interval > poll) {
+        poll = usb.last_poll + usb.interval;
+    }
+    poll = (poll + usb.interval - 1) / usb.interval * usb.interval;
+    usb.last_poll = poll;
+
+    // a busy USB thread runs the callback as soon as it is done, an idle one has to wake up
+    uint64_t callback = usb.thread_free;
+    if (poll >= usb.thread_free) {
+        callback = poll + usb.wake;
+        if (usb.stall && fake_usb_random(usb) % 100 == 0) {
+            callback += fake_usb_random(usb) * usb.stall / 65536;
+        }
+    }
+    usb.thread_free = callback + usb.callback_cost;
+    usb.pending_at[usb.head] = usb.thread_free;
+    usb.head = (usb.head + 1) % usb.transfers;
+
+    latency_record(usb.wait, callback - ready);
+    if (!usb.bytes) {
+        usb.first_ready = ready;
+    }
+    usb.bytes += length;
+    usb.last_callback   = callback;
+    usb.last_completion = callback;
+    usb.last_fill       = length;
+    return callback;
+}
+
+// when the transfer at next completes, UINT64_MAX once the capture is done
+inline uint64_t fake_usb_next_time(fake_usb_t& usb)
+{
+    if (usb.next >= usb.count) {
+        return UINT64_MAX;
+    }
+
+    fake_usb_packet_t& packet = usb.packets[usb.next];
+    if (!usb.transfers) {
+        return packet.time + usb.offset;
+    }
+    if (!usb.next_known) {
+        usb.next_time  = fake_usb_complete(usb, packet.time + usb.offset, packet.length);
+        usb.next_known = true;
+    }
+    return usb.next_time;
+}
+
+// bytes per second from the first payload ready to the last callback
+inline double fake_usb_throughput(fake_usb_t& usb)
+{
+    if (usb.last_callback <= usb.first_ready) {
+        return 0.0;
+    }
+
+    return usb.bytes * 1000000.0 / (usb.last_callback - usb.first_ready);
+}
+
+// complete every transfer recorded before until, *now follows the completion times.
+// false once the capture is done.
+inline bool fake_usb_replay(fake_usb_t& usb, uint64_t until, uint64_t *now,
+                            midi_input_t& input, midi_queue_t& queue)
+{
+    while (usb.next < usb.count) {
+        fake_usb_packet_t& packet = usb.packets[usb.next];
+        uint64_t time = fake_usb_next_time(usb);
+        if (time >= until) {
+            return true;
+        }
+
+        *now = time;
+        process_incoming(packet.buffer, packet.length, time, input, queue);
+        usb.next++;
+        usb.next_known = false;
+    }
+
+    return false;
+}
+
+#endif
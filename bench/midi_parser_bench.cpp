@@ -0,0 +1,285 @@
+/*
+ * bytes per second of the MIDI parser, compared to the byte by byte
+ * parser ultranova4linux used before
+ *
+ * usage: midi_parser_bench [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <queue>
+#include <boost/assert.hpp>
+
+#include "../src/midi_parser.h"
+
+using std::vector;
+using std::queue;
+
+// USB transfers are at most this long
+#define CHUNK_SIZE 32
+
+// counts what it gets, and keeps sysex bodies like the sysex arena does
+struct count_handler_t {
+    unsigned long messages;
+    unsigned long sysex;
+    unsigned long sysex_bytes;
+    uint8_t sink[4096];
+    uint32_t sink_pos;
+
+    void message(const uint8_t *bytes, int size) { messages++; }
+    void sysex_begin() {}
+    void sysex_data(const uint8_t *bytes, int size)
+    {
+        sysex_bytes += size;
+        // only the last bytes stay, in as many memcpys as the arena needs
+        if (size > (int)sizeof(sink)) {
+            bytes += size - sizeof(sink);
+            sink_pos += size - sizeof(sink);
+            size = sizeof(sink);
+        }
+        uint32_t offset = sink_pos & (sizeof(sink) - 1);
+        size_t first = sizeof(sink) - offset;
+        if (first > (size_t)size) {
+            first = size;
+        }
+        memcpy(sink + offset, bytes, first);
+        memcpy(sink, bytes + first, size - first);
+        sink_pos += size;
+    }
+    void sysex_end(bool complete) { sysex += complete; }
+};
+
+/*
+ * the old parser: process_incoming() of ultranova4linux before the
+ * parser rewrite, as it was, without libusb and the Automap hook. Every
+ * message is a vector, grown byte by byte and copied into a queue.
+ */
+
+size_t midi_event_size(uint8_t firstByte)
+{
+    size_t result = 3;
+
+    uint8_t firstNibble = firstByte & 0xf0;
+    if (firstNibble == 0xc0 ||
+        firstNibble == 0xd0 ||
+        firstByte == 0xf3) {
+        result = 2;
+    }
+
+    uint8_t secondNibble = 0x0f & firstByte;
+    if (firstNibble == 0xf0 &&
+        secondNibble != 0 &&
+        secondNibble != 2 &&
+        secondNibble != 3) {
+        result = 1;
+    }
+
+    if (firstByte == 0xf0) {
+        return 0;
+    }
+
+    return result;
+}
+
+typedef struct {
+    struct timespec time;
+    vector<uint8_t> buffer;
+} midi_message_t;
+
+void process_incoming(const uint8_t *transfer_buffer, int transfer_size, struct timespec time, midi_message_t& msg, queue<midi_message_t>& queue)
+{
+    // byte position inside the incoming transfer buffer
+    int input_pos = 0;
+
+    while(input_pos < transfer_size) {
+        int event_size = 0;
+        if (msg.buffer.empty()) {
+            event_size = midi_event_size(transfer_buffer[input_pos]);
+        } else {
+            event_size = midi_event_size(msg.buffer[0]);
+        }
+
+        if (event_size > 0 && event_size <= (int)msg.buffer.size()) {
+                fprintf(stderr, "ERROR: already complete message contained, but not submitted, event_size: %d, message buffer size: %d\n", event_size, (int)msg.buffer.size());
+                fprintf(stderr, "message buffer: \n");
+                for (int i=0; i < (int)msg.buffer.size(); i++){
+                    fprintf(stderr, " 0x%02x,", msg.buffer[i]);
+                }
+                fputs("\n", stderr);
+        }
+
+        if (event_size > 0) {
+            // how many bytes we still need to get in order
+            // for the current midi message to be complete
+            int remaining_size = event_size - msg.buffer.size();
+
+            if (remaining_size == 0) {
+                // complete event, submit the message
+                msg.time = time;
+                queue.push(msg);
+                msg.buffer.clear();
+            } else  if (input_pos + remaining_size > transfer_size) {
+                // in this case we received some more bytes for the
+                // current message, but the message is not complete yet
+                // so then append the incoming bytes to the message
+                int i = 0;
+                for (i = input_pos; i < transfer_size; i++) {
+                    msg.buffer.push_back(transfer_buffer[i]);
+                }
+                input_pos = i;
+            } else if (0 <= remaining_size && input_pos + remaining_size <= transfer_size) {
+                // in this case we have received a complete event,
+                // so copy the data over to the message buffer
+                int i = 0;
+                for (i = input_pos; i < input_pos + remaining_size; i++) {
+                    msg.buffer.push_back(transfer_buffer[i]);
+                }
+                input_pos = i;
+                BOOST_ASSERT(event_size == (int)msg.buffer.size());
+                msg.time = time;
+                // and submit the message
+                queue.push(msg);
+                msg.buffer.clear();
+                // and continue to read the next message from the remaining
+                // input transfer bytes
+            } else {
+                fprintf(stderr, "ERROR, invalid remaining size %d (input_pos: %d, event_size: %d, message buffer size: %d)\n", remaining_size, input_pos, (int)event_size, (int)msg.buffer.size());
+                fprintf(stderr, "message buffer: \n");
+                for (int i=0; i < (int)msg.buffer.size(); i++){
+                    fprintf(stderr, " 0x%02x,", msg.buffer[i]);
+                }
+                fputs("\n", stderr);
+                msg.buffer.clear();
+            }
+        } else {
+            // sysex
+            int i = 0;
+            for (i = input_pos; i < transfer_size; i++) {
+                if (transfer_buffer[i] != 0xf7) {
+                    msg.buffer.push_back(transfer_buffer[i]);
+                } else {
+                    msg.buffer.push_back(0xf7);
+                    msg.time = time;
+                    queue.push(msg);
+                    msg.buffer.clear();
+                    // account for last byte
+                    i++;
+                    // message complete, break out of for loop
+                    break;
+                }
+            }
+            input_pos = i;
+        }
+    }
+}
+
+// what the JACK thread did with the queue every cycle, counted like the new parser's messages
+void old_pickup(queue<midi_message_t>& queue, count_handler_t& handler)
+{
+    while (!queue.empty()) {
+        midi_message_t& msg = queue.front();
+        if (msg.buffer[0] == 0xf0) {
+            handler.sysex_data(&msg.buffer[0], msg.buffer.size());
+            handler.sysex_end(true);
+        } else {
+            handler.message(&msg.buffer[0], msg.buffer.size());
+        }
+        queue.pop();
+    }
+}
+
+/*
+ * test streams, without running status so the old parser understands them
+ */
+
+size_t fill_short(uint8_t *stream, size_t size)
+{
+    size_t pos = 0;
+    for (int n = 0; pos + 3 <= size; n++) {
+        switch (n % 4) {
+        case 0: stream[pos++] = 0x90; stream[pos++] = n & 0x7f; stream[pos++] = 100; break;
+        case 1: stream[pos++] = 0x80; stream[pos++] = n & 0x7f; stream[pos++] = 0;   break;
+        case 2: stream[pos++] = 0xb0; stream[pos++] = 1;        stream[pos++] = n & 0x7f; break;
+        case 3: stream[pos++] = 0xd0; stream[pos++] = n & 0x7f; break;
+        }
+    }
+    return pos;
+}
+
+size_t fill_sysex(uint8_t *stream, size_t size)
+{
+    size_t pos = 0;
+    while (pos + 512 <= size) {
+        stream[pos++] = 0xf0;
+        for (int i = 0; i < 510; i++) {
+            stream[pos++] = i & 0x7f;
+        }
+        stream[pos++] = 0xf7;
+    }
+    return pos;
+}
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(const char *name, const uint8_t *stream, size_t size)
+{
+    count_handler_t old_handler;
+    memset(&old_handler, 0, sizeof(old_handler));
+    midi_message_t msg;
+    queue<midi_message_t> old_queue;
+    struct timespec time = { 0, 0 };
+
+    double start = now();
+    for (size_t pos = 0; pos < size; pos += CHUNK_SIZE) {
+        process_incoming(stream + pos, size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE, time, msg, old_queue);
+        old_pickup(old_queue, old_handler);
+    }
+    double old_seconds = now() - start;
+
+    count_handler_t new_handler;
+    memset(&new_handler, 0, sizeof(new_handler));
+    midi_parser_t parser;
+    midi_parser_reset(parser);
+
+    start = now();
+    for (size_t pos = 0; pos < size; pos += CHUNK_SIZE) {
+        midi_parse(parser, stream + pos, size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE, new_handler);
+    }
+    double new_seconds = now() - start;
+
+    if (old_handler.messages != new_handler.messages ||
+        old_handler.sysex_bytes != new_handler.sysex_bytes) {
+        fprintf(stderr, "%s: parsers disagree, %lu/%lu messages, %lu/%lu sysex bytes\n", name,
+                old_handler.messages, new_handler.messages,
+                old_handler.sysex_bytes, new_handler.sysex_bytes);
+        exit(1);
+    }
+
+    printf("%-8s old %8.1f MB/s   new %8.1f MB/s   (%lu messages, %lu sysex)\n", name,
+           size / old_seconds / 1e6, size / new_seconds / 1e6,
+           new_handler.messages, new_handler.sysex);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = (argc > 1 ? atoi(argv[1]) : 64) * 1024 * 1024;
+    uint8_t *stream = (uint8_t *)malloc(size);
+    if (!stream) {
+        perror("malloc");
+        return 1;
+    }
+
+    run("short", stream, fill_short(stream, size));
+    run("sysex", stream, fill_sysex(stream, size));
+
+    free(stream);
+    return 0;
+}
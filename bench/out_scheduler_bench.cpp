@@ -0,0 +1,199 @@
+/*
+ * timing of the JACK to USB path: how far from the time its frame plays
+ * each event goes out, when a period is sent at once and when it goes
+ * through the out scheduler, like ultranova4linux --schedule-out
+ *
+ * usage: out_scheduler_bench [--nframes N] [--rate HZ] [--seconds S] [--events N] [--priority P]
+ *
+ * A fake JACK thread wakes once per period with a batch of notes at random
+ * frames, sending them the way jack_to_usb() does. The out thread sleeps
+ * like the one of the driver. Run it as root or with realtime limits and
+ * --priority to see what the driver gets with SCHED_FIFO.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <semaphore.h>
+
+#include "../src/out_scheduler.h"
+#include "../src/rt_thread.h"
+
+uint64_t usecs_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint32_t random_state = 1;
+
+int random_below(int n)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) % n;
+}
+
+out_scheduler_t scheduler;
+sem_t out_wakeup;
+volatile bool do_exit = false;
+
+rt_thread_t jack_thread = { "jack", 0, -1 };
+rt_thread_t out_thread  = { "out",  0, -1 };
+
+uint32_t nframes = 1024;
+uint32_t sample_rate = 48000;
+int seconds = 5;
+int events_per_period = 16;
+bool scheduled;
+
+// the distance of each event from its time, both ways
+latency_histogram_t timing[2];
+
+void record_timing(latency_histogram_t& histogram, uint64_t time)
+{
+    int64_t off = (int64_t)(usecs_now() - time);
+    latency_record(histogram, off < 0 ? -off : off);
+}
+
+// stands in for device_send()
+struct timing_output_t {
+    unsigned long sent;
+
+    bool send(const uint8_t *bytes, size_t size, uint64_t deadline)
+    {
+        record_timing(timing[1], deadline);
+        sent++;
+        return true;
+    }
+};
+
+timing_output_t output;
+
+void *out_thread_main(void *arg)
+{
+    uint64_t next = 0;
+
+    while (!do_exit) {
+        uint64_t now = usecs_now();
+        if (!next) {
+            sem_wait(&out_wakeup);
+        } else if (next > now) {
+            struct timespec deadline = monotonic_timespec(next);
+            if (sem_clockwait(&out_wakeup, CLOCK_MONOTONIC, &deadline) != 0 && errno == ETIMEDOUT) {
+                now = usecs_now();
+                rt_thread_record_latency(out_thread, now > next ? now - next : 0);
+            }
+        }
+
+        next = out_send_due(scheduler, usecs_now(), output);
+    }
+
+    return NULL;
+}
+
+void *jack_thread_main(void *arg)
+{
+    double period = 1e6 * nframes / sample_rate;
+    uint64_t start = usecs_now() + 10000;
+    long periods = (long)(seconds * 1e6 / period);
+    uint8_t note_on[3] = { 0x90, 60, 100 };
+
+    for (long p = 0; p < periods; p++) {
+        uint64_t cycle_start = start + (uint64_t)(p * period);
+        struct timespec wakeup = monotonic_timespec(cycle_start);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL);
+        rt_thread_record_latency(jack_thread, usecs_now() - cycle_start);
+
+        // frames in ascending order, as in a JACK port buffer
+        uint32_t frame = 0;
+        for (int e = 0; e < events_per_period && frame < nframes; e++) {
+            frame += random_below(2 * nframes / events_per_period);
+            if (frame >= nframes) {
+                break;
+            }
+            uint64_t time = cycle_start + (uint64_t)(frame * period / nframes);
+            if (scheduled) {
+                out_schedule(scheduler, note_on, sizeof(note_on), time + (uint64_t)period);
+            } else {
+                record_timing(timing[0], time);
+            }
+        }
+        if (scheduled) {
+            sem_post(&out_wakeup);
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--nframes") == 0 && i + 1 < argc) {
+            nframes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            sample_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--events") == 0 && i + 1 < argc) {
+            events_per_period = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--priority") == 0 && i + 1 < argc) {
+            jack_thread.priority = atoi(argv[++i]);
+            out_thread.priority  = jack_thread.priority - 5;
+        } else {
+            fprintf(stderr, "usage: %s [--nframes N] [--rate HZ] [--seconds S] [--events N] [--priority P]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!nframes || !sample_rate || events_per_period < 1) {
+        fprintf(stderr, "nframes, rate and events must be positive\n");
+        return 1;
+    }
+
+    if (!out_scheduler_init(scheduler, SYSEX_ARENA_DEFAULT_SIZE)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    sem_init(&out_wakeup, 0, 0);
+
+    printf("%u frames at %u Hz, one period is %.0f usecs, up to %d events per period, %d s each\n",
+           nframes, sample_rate, 1e6 * nframes / sample_rate, events_per_period, seconds);
+
+    // sent at once, then scheduled
+    for (int mode = 0; mode < 2; mode++) {
+        scheduled = mode == 1;
+        do_exit = false;
+        if (scheduled && !rt_thread_start(out_thread, out_thread_main, NULL)) {
+            return 1;
+        }
+        if (!rt_thread_start(jack_thread, jack_thread_main, NULL)) {
+            return 1;
+        }
+        pthread_join(jack_thread.thread, NULL);
+        if (scheduled) {
+            // the last period is still due
+            usleep(2 * 1e6 * nframes / sample_rate);
+            do_exit = true;
+            sem_post(&out_wakeup);
+            pthread_join(out_thread.thread, NULL);
+        }
+
+        latency_histogram_t& histogram = timing[mode];
+        printf("  %-13s %8lu events, timing error p50 %6lu usecs, p99 %6lu usecs, max %6lu usecs\n",
+               scheduled ? "scheduled:" : "sent at once:", (unsigned long)histogram.count.load(),
+               (unsigned long)latency_percentile(histogram, 0.50),
+               (unsigned long)latency_percentile(histogram, 0.99),
+               (unsigned long)histogram.max.load());
+    }
+    printf("  %lu dropped\n", (unsigned long)scheduler.overflows);
+    fflush(stdout);
+    rt_thread_print_stats(jack_thread);
+    rt_thread_print_stats(out_thread);
+
+    out_scheduler_free(scheduler);
+    return 0;
+}
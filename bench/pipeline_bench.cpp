@@ -0,0 +1,440 @@
+/*
+ * throughput, allocations and frame placement of the USB to JACK path
+ * (process_incoming() -> queue -> pickup_from_queue()), on a fake USB
+ * device and a fake JACK, so it runs without hardware or jackd
+ *
+ * usage: pipeline_bench [--capture FILE] [--repeat N] [--nframes N] [--rate HZ] [--immediate]
+ *                       [--thin MSECS[:DELTA]] [--fixed-latency] [--process-delay USECS] [--out]
+ *                       [--in-transfers N] [--usb-interval USECS] [--usb-wake USECS] [--usb-stall USECS]
+ *
+ * --immediate passes every transfer on as soon as it is parsed, with
+ * drain_queue() like the ALSA backend, instead of once per JACK cycle,
+ * to compare the latency of both.
+ *
+ * --thin thins aftertouch, control changes and pitch bend like the
+ * --thin-* options of the driver, to see how many events it saves.
+ *
+ * --fixed-latency places every event exactly one period after it came in,
+ * like the option of the driver. --process-delay lets each cycle run that
+ * long after it started, as a real JACK process callback does, so that
+ * events which came in meanwhile are already queued; the frame placement
+ * error shows what each mode does with them.
+ *
+ * --out sends the traffic the other way, as if it came from JACK: every
+ * period, what came in during it goes through two transfer pools on a
+ * fake libusb, one submitting each message on its own, one batching like
+ * --batch-out, and the USB OUT submissions per period of both are counted.
+ *
+ * --in-transfers keeps N IN transfers in flight on the fake device instead
+ * of completing every payload at its recorded time, see fake_usb.h: the
+ * host polls every --usb-interval (1000, full speed), the USB thread wakes
+ * up --usb-wake after a completion (50) and one wakeup in 100 stalls for
+ * up to --usb-stall more (4000). Run it with 1, 2 and 4 to compare the
+ * time from a payload being ready to its callback, and the throughput.
+ *
+ * Without a capture a synthetic one is replayed: notes, controllers,
+ * aftertouch with running status, and a bank dump of 128 sysex patches.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fake_usb.h"
+#include "fake_jack.h"
+#include "../src/transfer_pool.h"
+
+// malloc() and friends are counted, glibc only
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+unsigned long allocations;
+
+extern "C" void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+// the clock of the queue runs in capture time
+uint64_t fake_now;
+
+uint64_t fake_clock()
+{
+    return fake_now;
+}
+
+uint32_t random_state = 1;
+
+int random_below(int n)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) % n;
+}
+
+void generate_capture(fake_usb_t& usb, uint64_t seconds)
+{
+    uint64_t end = seconds * 1000000;
+    // the bank dump, one 32 byte transfer per millisecond
+    uint64_t dump_start = end / 2;
+    uint64_t dump_end   = dump_start + 128 * 1024 / FAKE_USB_PACKET_SIZE * 1000;
+    uint8_t buf[FAKE_USB_PACKET_SIZE];
+
+    for (uint64_t time = 1000; time < end; time += 250 + random_below(1000)) {
+        if (dump_start <= time && time < dump_end) {
+            continue;
+        }
+
+        int length = 0;
+        switch (random_below(4)) {
+        case 0: {
+            uint8_t note = 36 + random_below(48);
+            buf[length++] = 0x90; buf[length++] = note; buf[length++] = 1 + random_below(127);
+            buf[length++] = 0x80; buf[length++] = note; buf[length++] = 0;
+            break;
+        }
+        case 1:
+            // mod wheel sweep, running status
+            buf[length++] = 0xb0;
+            for (int i = 0; i < 4; i++) {
+                buf[length++] = 1; buf[length++] = random_below(128);
+            }
+            break;
+        case 2:
+            // channel aftertouch, running status
+            buf[length++] = 0xd0;
+            for (int i = 0; i < 8; i++) {
+                buf[length++] = random_below(128);
+            }
+            break;
+        case 3:
+            buf[length++] = 0xe0; buf[length++] = random_below(128); buf[length++] = random_below(128);
+            buf[length++] = 0xf8;
+            break;
+        }
+        fake_usb_add(usb, time, buf, length);
+    }
+
+    uint8_t patch[1024];
+    uint64_t time = dump_start;
+    for (int p = 0; p < 128; p++) {
+        patch[0] = 0xf0;
+        for (size_t i = 1; i < sizeof(patch) - 1; i++) {
+            patch[i] = (p + i) & 0x7f;
+        }
+        patch[sizeof(patch) - 1] = 0xf7;
+        for (size_t pos = 0; pos < sizeof(patch); pos += FAKE_USB_PACKET_SIZE) {
+            fake_usb_add(usb, time, patch + pos, FAKE_USB_PACKET_SIZE);
+            time += 1000;
+        }
+    }
+
+    // replay in time order
+    struct by_time {
+        static int compare(const void *a, const void *b)
+        {
+            uint64_t ta = ((const fake_usb_packet_t *)a)->time;
+            uint64_t tb = ((const fake_usb_packet_t *)b)->time;
+            return ta < tb ? -1 : ta > tb;
+        }
+    };
+    qsort(usb.packets, usb.count, sizeof(fake_usb_packet_t), by_time::compare);
+}
+
+double wall_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+fake_usb_t   usb;
+fake_jack_t  jack;
+fake_port_t  port;
+midi_queue_t queue;
+midi_input_t input;
+midi_thinning_t thinning;
+
+// drain_queue() output for --immediate
+struct counting_output_t {
+    unsigned long events;
+    unsigned long bytes;
+
+    bool send(const uint8_t *buffer, size_t size)
+    {
+        events++;
+        bytes += size;
+        return true;
+    }
+};
+
+counting_output_t immediate_output;
+
+// --out: unbatched and batched, like the driver without and with --batch-out
+transfer_pool_t out_pools[2];
+// USB OUT submissions in each period which sent anything
+latency_histogram_t out_submissions[2];
+
+void out_done(struct libusb_transfer *transfer)
+{
+    transfer_pool_release(transfer);
+}
+
+// drain_queue() output for --out, the same messages into both pools
+struct pool_output_t {
+    bool send(const uint8_t *buffer, size_t size)
+    {
+        bool sent = transfer_pool_send(out_pools[0], buffer, size);
+        return transfer_pool_batch(out_pools[1], buffer, size) && sent;
+    }
+};
+
+pool_output_t pool_output;
+
+// one period of jack_to_usb(), everything is taken by the device before the next one
+void out_period()
+{
+    unsigned long before[2];
+    for (int p = 0; p < 2; p++) {
+        before[p] = out_pools[p].submitted;
+    }
+
+    drain_queue(queue, pool_output);
+    transfer_pool_flush(out_pools[1]);
+
+    if (out_pools[0].submitted != before[0]) {
+        for (int p = 0; p < 2; p++) {
+            latency_record(out_submissions[p], out_pools[p].submitted - before[p]);
+        }
+    }
+    fake_libusb_complete();
+}
+
+int main(int argc, char *argv[])
+{
+    const char *capture = NULL;
+    int repeat = 20;
+    uint32_t nframes = 256;
+    uint32_t sample_rate = 48000;
+    bool immediate = false;
+    bool out = false;
+    uint64_t process_delay = 0;
+    int in_transfers = 0;
+    uint64_t usb_interval = 1000;
+    uint64_t usb_wake = 50;
+    uint64_t usb_stall = 4000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--nframes") == 0 && i + 1 < argc) {
+            nframes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            sample_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--immediate") == 0) {
+            immediate = true;
+        } else if (strcmp(argv[i], "--thin") == 0 && i + 1 < argc) {
+            int msecs = 0, delta = 0;
+            sscanf(argv[++i], "%d:%d", &msecs, &delta);
+            for (int type = 0; type < THIN_TYPES; type++) {
+                thinning.rules[type].window = (uint64_t)msecs * 1000;
+                thinning.rules[type].delta  = delta;
+            }
+            queue.thinning = &thinning;
+        } else if (strcmp(argv[i], "--fixed-latency") == 0) {
+            queue.fixed_latency = true;
+        } else if (strcmp(argv[i], "--process-delay") == 0 && i + 1 < argc) {
+            process_delay = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--out") == 0) {
+            out = true;
+        } else if (strcmp(argv[i], "--in-transfers") == 0 && i + 1 < argc) {
+            in_transfers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--usb-interval") == 0 && i + 1 < argc) {
+            usb_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--usb-wake") == 0 && i + 1 < argc) {
+            usb_wake = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--usb-stall") == 0 && i + 1 < argc) {
+            usb_stall = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--capture FILE] [--repeat N] [--nframes N] [--rate HZ] [--immediate] "
+                    "[--thin MSECS[:DELTA]] [--fixed-latency] [--process-delay USECS] [--out] "
+                    "[--in-transfers N] [--usb-interval USECS] [--usb-wake USECS] [--usb-stall USECS]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (!fake_usb_init(usb, 1024 * 1024) ||
+        !midi_queue_init(queue, SYSEX_ARENA_DEFAULT_SIZE, fake_clock)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    queue.sysex_split = true;
+    for (int p = 0; p < 2; p++) {
+        if (out && !transfer_pool_init(out_pools[p], NULL, LIBUSB_ENDPOINT_OUT | 3, out_done)) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    if (capture) {
+        if (!fake_usb_load(usb, capture)) {
+            return 1;
+        }
+    } else {
+        generate_capture(usb, 60);
+    }
+    if (!usb.count) {
+        fprintf(stderr, "empty capture\n");
+        return 1;
+    }
+    if (in_transfers) {
+        fake_usb_transfers(usb, in_transfers, usb_interval, usb_wake, usb_stall);
+    }
+
+    uint64_t first    = usb.packets[0].time;
+    uint64_t duration = fake_usb_duration(usb) + 1000;
+    fake_jack_init(jack, nframes, sample_rate, first);
+
+    unsigned long start_allocations = allocations;
+    double start = wall_clock();
+
+    for (int r = 0; r < repeat; r++) {
+        fake_usb_rewind(usb, r * duration);
+        if (immediate) {
+            // one transfer at a time, each drained as soon as it is parsed
+            while (usb.next < usb.count) {
+                fake_usb_replay(usb, fake_usb_next_time(usb) + 1, &fake_now, input, queue);
+                thin_flush_queue(queue, fake_now);
+                drain_queue(queue, immediate_output);
+            }
+            continue;
+        }
+        if (out) {
+            while (fake_usb_replay(usb, fake_jack_cycle_start(jack), &fake_now, input, queue)) {
+                fake_now = fake_jack_cycle_start(jack);
+                thin_flush_queue(queue, fake_now);
+                out_period();
+                jack.cycles++;
+            }
+            continue;
+        }
+        // the cycle the capture ends in runs with the start of the next repeat
+        while (fake_usb_replay(usb, fake_jack_cycle_start(jack) + process_delay, &fake_now, input, queue)) {
+            fake_now = fake_jack_cycle_start(jack) + process_delay;
+            thin_flush_queue(queue, fake_now);
+            fake_jack_cycle(jack, port, queue);
+        }
+    }
+    // whatever is still held back or queued
+    thin_flush_queue(queue, UINT64_MAX);
+    if (immediate) {
+        drain_queue(queue, immediate_output);
+    }
+    if (out) {
+        out_period();
+    }
+    while (queue.events.read_available()) {
+        fake_now = fake_jack_cycle_start(jack);
+        fake_jack_cycle(jack, port, queue);
+    }
+
+    double seconds = wall_clock() - start;
+    unsigned long replay_allocations = allocations - start_allocations;
+
+    unsigned long events = input.parser.messages + input.parser.sysex_messages;
+    unsigned long bytes  = 0;
+    for (int i = 0; i < usb.count; i++) {
+        bytes += usb.packets[i].length;
+    }
+    bytes *= repeat;
+
+    if (immediate) {
+        printf("replayed %d transfers %d times, %.1f s of capture, delivered immediately\n",
+               usb.count, repeat, duration / 1e6);
+    } else if (out) {
+        printf("replayed %d transfers %d times, %.1f s of capture, to USB in %u frame periods at %u Hz, "
+               "%d byte packets\n",
+               usb.count, repeat, duration / 1e6, nframes, sample_rate, fake_libusb_max_packet_size);
+    } else {
+        printf("replayed %d transfers %d times, %.1f s of capture, %u frames at %u Hz, %s\n",
+               usb.count, repeat, duration / 1e6, nframes, sample_rate,
+               queue.fixed_latency ? "fixed latency" : "lowest latency");
+    }
+    printf("  %lu events (%lu sysex) in %.3f s: %.0f events/s, %.1f MB/s\n",
+           events, input.parser.sysex_messages, seconds, events / seconds, bytes / seconds / 1e6);
+    printf("  allocations while replaying: %lu\n", replay_allocations);
+    if (usb.transfers) {
+        printf("  %d IN transfers, polled every %lu usecs: ready to callback p50 %lu usecs, p99 %lu usecs, "
+               "max %lu usecs, waited for a transfer up to %lu usecs, %.0f bytes/s\n",
+               usb.transfers, (unsigned long)usb.interval,
+               (unsigned long)latency_percentile(usb.wait, 0.50),
+               (unsigned long)latency_percentile(usb.wait, 0.99),
+               (unsigned long)usb.wait.max.load(), (unsigned long)usb.max_starved,
+               fake_usb_throughput(usb));
+    }
+    if (immediate) {
+        printf("  %lu sends, %lu bytes, %lu dropped\n",
+               immediate_output.events, immediate_output.bytes, (unsigned long)queue.overflows);
+    } else if (out) {
+        printf("  %lu messages in %lu periods, %lu of them sending\n",
+               (unsigned long)out_pools[0].messages, jack.cycles,
+               (unsigned long)out_submissions[0].count.load());
+        for (int p = 0; p < 2; p++) {
+            latency_histogram_t& submissions = out_submissions[p];
+            unsigned long count = submissions.count.load();
+            printf("  %-10s %8lu USB OUT submissions, per sending period avg %.2f, p50 %lu, p99 %lu, max %lu, "
+                   "%lu sends without a free transfer\n",
+                   p ? "batched:" : "unbatched:", (unsigned long)out_pools[p].submitted.load(),
+                   count ? (double)out_pools[p].submitted / count : 0.0,
+                   (unsigned long)latency_percentile(submissions, 0.50),
+                   (unsigned long)latency_percentile(submissions, 0.99),
+                   (unsigned long)submissions.max.load(),
+                   (unsigned long)out_pools[p].exhausted.load());
+        }
+    } else {
+        printf("  %lu events placed in %lu cycles, %lu dropped, %lu bytes without status\n",
+               port.events, jack.cycles, (unsigned long)queue.overflows + queue.sysex_oversize,
+               input.parser.dropped_bytes);
+        printf("  sysex: %lu delivered, %lu fragments, waited for port buffer room %lu times\n",
+               queue.sysex_delivered, queue.sysex_fragments, queue.sysex_carried);
+        printf("  frame placement error: p50 %lu usecs, p99 %lu usecs, max %lu usecs (one frame is %.1f usecs)\n",
+               (unsigned long)latency_percentile(port.placement_error, 0.50),
+               (unsigned long)latency_percentile(port.placement_error, 0.99),
+               (unsigned long)port.placement_error.max.load(),
+               1000000.0 / sample_rate);
+    }
+    if (queue.thinning) {
+        unsigned long offered = 0, removed = 0;
+        for (int type = 0; type < THIN_TYPES; type++) {
+            offered += thinning.offered[type];
+            removed += thinning.removed[type];
+        }
+        printf("  thinning: %lu of %lu aftertouch, control change and pitch bend events removed\n", removed, offered);
+    }
+    fflush(stdout);
+    fprintf(stderr, "latency in capture time:\n");
+    latency_print(queue.latency.parse,    "parse");
+    latency_print(queue.latency.queue,    "queue");
+    latency_print(queue.latency.delivery, "delivery");
+    latency_print(queue.latency.total,    "total");
+
+    midi_queue_free(queue);
+    fake_usb_free(usb);
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * ALSA sequencer ports, for running without JACK
+ *
+ * The keyboard endpoints show up as ports of one sequencer client, and
+ * events go out as soon as they are parsed, instead of once per JACK
+ * period. alsa-lib is not thread safe on one handle, so writes from the
+ * USB and the controller thread are serialized by a priority inheriting
+ * mutex. Only one thread reads.
+ */
+#ifndef ALSA_SEQ_H
+#define ALSA_SEQ_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+#include <boost/atomic.hpp>
+
+// largest sysex piece per sequencer event, like the rawmidi bridge of ALSA
+#define ALSA_SYSEX_CHUNK 256
+
+typedef struct {
+    snd_seq_t *seq;
+    pthread_mutex_t lock;
+    // events the sequencer had no room for
+    boost::atomic<unsigned long> dropped;
+} alsa_seq_t;
+
+inline bool alsa_seq_open(alsa_seq_t& alsa, const char *client_name)
+{
+    int r = snd_seq_open(&alsa.seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
+    if (r < 0) {
+        fprintf(stderr, "cannot open ALSA sequencer: %s\n", snd_strerror(r));
+        alsa.seq = NULL;
+        return false;
+    }
+    snd_seq_set_client_name(alsa.seq, client_name);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(&alsa.lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return true;
+}
+
+inline void alsa_seq_close(alsa_seq_t& alsa)
+{
+    if (alsa.seq) {
+        snd_seq_close(alsa.seq);
+        alsa.seq = NULL;
+        pthread_mutex_destroy(&alsa.lock);
+    }
+}
+
+// readable ports carry what the keyboard sends, writable ones what it gets, -1 on error
+inline int alsa_seq_port(alsa_seq_t& alsa, const char *name, bool readable)
+{
+    unsigned int caps = readable ?
+        SND_SEQ_PORT_CAP_READ  | SND_SEQ_PORT_CAP_SUBS_READ :
+        SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
+    int port = snd_seq_create_simple_port(alsa.seq, name, caps,
+                                          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_HARDWARE);
+    if (port < 0) {
+        fprintf(stderr, "cannot create ALSA port %s: %s\n", name, snd_strerror(port));
+    }
+    return port;
+}
+
+// drain_queue() output into one readable port, used by a single thread
+struct alsa_output_t {
+    alsa_seq_t *alsa;
+    int port;
+    // turns MIDI bytes into sequencer events, sysex ALSA_SYSEX_CHUNK bytes at a time
+    snd_midi_event_t *encoder;
+
+    bool init(alsa_seq_t& seq, const char *name)
+    {
+        alsa = &seq;
+        port = alsa_seq_port(seq, name, true);
+        return port >= 0 && snd_midi_event_new(ALSA_SYSEX_CHUNK, &encoder) >= 0;
+    }
+
+    void free()
+    {
+        if (encoder) {
+            snd_midi_event_free(encoder);
+            encoder = NULL;
+        }
+    }
+
+    bool send(const uint8_t *bytes, size_t size)
+    {
+        bool sent = true;
+
+        while (size > 0) {
+            snd_seq_event_t event;
+            snd_seq_ev_clear(&event);
+            long used = snd_midi_event_encode(encoder, bytes, size, &event);
+            if (used <= 0) {
+                return false;
+            }
+            bytes += used;
+            size  -= used;
+
+            if (event.type == SND_SEQ_EVENT_NONE) {
+                continue;
+            }
+
+            snd_seq_ev_set_source(&event, port);
+            snd_seq_ev_set_subs(&event);
+            snd_seq_ev_set_direct(&event);
+
+            pthread_mutex_lock(&alsa->lock);
+            int r = snd_seq_event_output_direct(alsa->seq, &event);
+            pthread_mutex_unlock(&alsa->lock);
+            if (r < 0) {
+                alsa->dropped++;
+                sent = false;
+            }
+        }
+
+        return sent;
+    }
+};
+
+#endif
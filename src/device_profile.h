@@ -0,0 +1,126 @@
+/*
+ * what differs between the supported Novation models
+ *
+ * Each model is a profile type of compile time constants: its USB product
+ * id, endpoints, the interfaces to claim, whether it has the Automap
+ * controller endpoint with its LEDs and octave buttons, and the greeting
+ * sent in the Automap handshake. device_profile() turns one into the
+ * device_profile_t the driver reads at runtime, and checks it at compile
+ * time on the way. Only the JACK period has a path per model:
+ * process_device() and device_period_done() are templates on whether
+ * there is a controller endpoint. The USB callbacks serve one endpoint
+ * each and never look at the profile; the controller and out threads,
+ * LED flushing and setup read device_profile_t at runtime.
+ * A new model is one more profile and one more entry in device_profiles[]
+ * of driver.cpp.
+ */
+#ifndef DEVICE_PROFILE_H
+#define DEVICE_PROFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <boost/static_assert.hpp>
+#include <libusb-1.0/libusb.h>
+
+#include "automap_protocol.h"
+
+#define NOVATION_VENDOR_ID 0x1235
+// Automap LED state a device keeps, enough for every profile
+#define AUTOMAP_LEDS 128
+
+struct ultranova_profile_t {
+    static const char *name() { return "ultranova"; }
+    static const uint16_t product_id        = 0x0011;
+    static const int      midi_endpoint_in  = LIBUSB_ENDPOINT_IN  | 3;
+    static const int      midi_endpoint_out = LIBUSB_ENDPOINT_OUT | 3;
+    // a bit per interface
+    static const unsigned interfaces        = 1 << 0 | 1 << 1 | 1 << 3;
+
+    // Automap: encoders, buttons and their LEDs on an endpoint of their own
+    static const bool     controller              = true;
+    static const int      controller_endpoint_in  = LIBUSB_ENDPOINT_IN  | 5;
+    static const int      controller_endpoint_out = LIBUSB_ENDPOINT_OUT | 5;
+    static const int      controller_packet_size  = 0x18;
+    static const int      leds                    = 128;
+    static const uint8_t *greeting() { return ultranova4linux_greeting; }
+    static const size_t   greeting_size           = sizeof(ultranova4linux_greeting);
+    static const uint8_t *button_octave_minus() { return ultranova_button_octave_minus; }
+    static const uint8_t *button_octave_plus()  { return ultranova_button_octave_plus; }
+    static const uint8_t  led_octave_minus        = 9;
+    static const uint8_t  led_octave_plus         = 11;
+};
+
+struct mininova_profile_t {
+    static const char *name() { return "mininova"; }
+    static const uint16_t product_id        = 0x001e;
+    static const int      midi_endpoint_in  = LIBUSB_ENDPOINT_IN  | 1;
+    static const int      midi_endpoint_out = LIBUSB_ENDPOINT_OUT | 2;
+    static const unsigned interfaces        = 1 << 0;
+
+    static const bool     controller              = false;
+    static const int      controller_endpoint_in  = 0;
+    static const int      controller_endpoint_out = 0;
+    static const int      controller_packet_size  = 0;
+    static const int      leds                    = 0;
+    static const uint8_t *greeting() { return NULL; }
+    static const size_t   greeting_size           = 0;
+    static const uint8_t *button_octave_minus() { return NULL; }
+    static const uint8_t *button_octave_plus()  { return NULL; }
+    static const uint8_t  led_octave_minus        = 0;
+    static const uint8_t  led_octave_plus         = 0;
+};
+
+typedef struct {
+    const char *name;
+    uint16_t product_id;
+    int midi_endpoint_in;
+    int midi_endpoint_out;
+    unsigned interfaces;
+
+    bool controller;
+    int controller_endpoint_in;
+    int controller_endpoint_out;
+    int controller_packet_size;
+    int leds;
+    const uint8_t *greeting;
+    size_t greeting_size;
+    // three bytes each, NULL without a controller endpoint
+    const uint8_t *button_octave_minus;
+    const uint8_t *button_octave_plus;
+    uint8_t led_octave_minus;
+    uint8_t led_octave_plus;
+} device_profile_t;
+
+template <typename profile_t>
+inline device_profile_t device_profile()
+{
+    // every profile of device_profiles[] comes through here
+    BOOST_STATIC_ASSERT(profile_t::leds <= AUTOMAP_LEDS);
+    BOOST_STATIC_ASSERT(profile_t::controller || profile_t::leds == 0);
+    BOOST_STATIC_ASSERT(!profile_t::controller ||
+                        (profile_t::led_octave_minus < profile_t::leds &&
+                         profile_t::led_octave_plus  < profile_t::leds &&
+                         profile_t::greeting_size > 0));
+
+    device_profile_t profile = {
+        profile_t::name(),
+        profile_t::product_id,
+        profile_t::midi_endpoint_in,
+        profile_t::midi_endpoint_out,
+        profile_t::interfaces,
+        profile_t::controller,
+        profile_t::controller_endpoint_in,
+        profile_t::controller_endpoint_out,
+        profile_t::controller_packet_size,
+        profile_t::leds,
+        profile_t::greeting(),
+        profile_t::greeting_size,
+        profile_t::button_octave_minus(),
+        profile_t::button_octave_plus(),
+        profile_t::led_octave_minus,
+        profile_t::led_octave_plus,
+    };
+    return profile;
+}
+
+#endif
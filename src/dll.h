@@ -0,0 +1,40 @@
+/*
+ * second order delay locked loop, smoothes the jitter out of
+ * the wakeup times of a periodic thread
+ * (see Fons Adriaensen, "Using a DLL to filter time")
+ */
+#ifndef DLL_H
+#define DLL_H
+
+#include <math.h>
+
+typedef struct {
+    // loop coefficients
+    double b, c;
+    // filtered start of the current and of the next period
+    double t0, t1;
+    // filtered period length
+    double e2;
+} dll_t;
+
+// time and period in usecs, bandwidth in Hz
+inline void dll_init(dll_t& dll, double time, double period, double bandwidth)
+{
+    double omega = 2.0 * M_PI * bandwidth * period / 1000000.0;
+    dll.b  = sqrt(2.0) * omega;
+    dll.c  = omega * omega;
+    dll.e2 = period;
+    dll.t0 = time;
+    dll.t1 = time + period;
+}
+
+// feed the measured start of the next period
+inline void dll_update(dll_t& dll, double time)
+{
+    double e = time - dll.t1;
+    dll.t0  = dll.t1;
+    dll.t1 += dll.b * e + dll.e2;
+    dll.e2 += dll.c * e;
+}
+
+#endif
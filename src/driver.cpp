@@ -0,0 +1,1483 @@
+/*
+ * the driver library: USB transport, Automap and mapping of every
+ * connected Ultranova and Mininova, see driver.h
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <new>
+
+#include "automap_protocol.h"
+#include "driver.h"
+
+#define IS_NOTE_ON(a)    (((a) & 0xf0) == 0x90)
+#define IS_NOTE_OFF(a)   (((a) & 0xf0) == 0x80)
+#define IS_CONTROL_CHANGE(a) (((a) & 0xf0) == 0xb0)
+#define CC_ALL_SOUND_OFF 120
+#define CC_ALL_NOTES_OFF 123
+
+// what the frontend passed to driver_open()
+static driver_config_t config;
+
+void driver_config_init(driver_config_t& config)
+{
+    memset(&config, 0, sizeof(config));
+    config.in_transfer_count   = 2;
+    config.sysex_buffer_size   = SYSEX_ARENA_DEFAULT_SIZE;
+    config.recorder_file       = FLIGHT_DEFAULT_FILE;
+    config.recorder_size       = FLIGHT_DEFAULT_SIZE;
+    config.usb_priority        = 80;
+    config.usb_cpu             = -1;
+    config.controller_priority = 40;
+    config.controller_cpu      = -1;
+    config.out_priority        = 75;
+}
+
+uint64_t monotonic_usecs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t (*usecs_now)() = monotonic_usecs;
+
+// config.drain
+void (*drain_device_queue)(device_t& dev, midi_queue_t& queue) = NULL;
+
+// USB
+#define LEN_IN_BUFFER IN_TRANSFER_BUFFER_SIZE
+
+static libusb_context *ctx = NULL;
+static bool usb_initialized = false;
+static libusb_hotplug_callback_handle hotplug_handle;
+static bool hotplug = false;
+
+// OSC, sent from a worker thread with normal priority
+osc_sender_t ardour;
+
+// always on, unless config.recorder_size is 0
+flight_recorder_t recorder;
+
+// set to stop all threads, the USB thread sets it itself when it fails
+static volatile bool do_exit = false;
+// set by the USB thread before it ends on a libusb error
+static volatile bool failed = false;
+
+// the keyboard MIDI endpoint is serviced by the USB event thread itself,
+// the Automap controller endpoint on a thread of its own with lower priority
+rt_thread_t usb_thread        = { "usb",        80, -1 };
+rt_thread_t controller_thread = { "controller", 40, -1 };
+rt_thread_t osc_thread        = { "osc",         0, -1 };
+// with config.schedule_out, what the frontend sends goes out from a thread of its own
+rt_thread_t out_thread        = { "out",        75, -1 };
+static bool usb_running, controller_running, osc_running, out_running;
+// whether the controller thread is needed at all
+static bool any_controller = false;
+
+// posted for packets and LED changes of any device
+sem_t controller_wakeup;
+// posted when the frontend scheduled events
+sem_t out_wakeup;
+
+void print_libusb_transfer(struct libusb_transfer *p_t);
+void cb_controller_out(struct libusb_transfer *transfer);
+void cb_midi_out(struct libusb_transfer *transfer);
+
+const char* state_names[] = {
+    "STARTUP",
+    "WAIT_FOR_AUTOMAP",
+    "AUTOMAP_PRESSED",
+    "LISTEN",
+};
+
+device_t devices[MAX_DEVICES];
+int device_count = 0;
+
+void set_automap_led(device_t& dev, uint8_t led, uint8_t value)
+{
+    dev.leds_wanted[led & 0x7f].store(value, boost::memory_order_relaxed);
+    dev.leds_dirty.store(true, boost::memory_order_release);
+    dev.led_requests++;
+}
+
+// the device state is unknown, after startup or an Automap handshake
+void forget_automap_leds(device_t& dev)
+{
+    memset(dev.leds_shown, LED_UNKNOWN, sizeof(dev.leds_shown));
+    dev.leds_dirty = true;
+}
+
+// one write of LED changes: the device only shows them once it was sent
+bool write_automap_leds(device_t& dev, const uint8_t *buf, size_t length)
+{
+    if (!transfer_pool_send(dev.controller_out_pool, buf, length)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < length; i += 3) {
+        dev.leds_shown[buf[i + 1]] = buf[i + 2];
+    }
+    dev.led_changes += length / 3;
+    dev.led_writes++;
+    return true;
+}
+
+// runs on the controller thread, false if some changes could not be
+// sent and have to be tried again
+bool flush_automap_leds(device_t& dev)
+{
+    if (!dev.leds_dirty.exchange(false, boost::memory_order_acquire)) {
+        return true;
+    }
+
+    uint8_t buf[TRANSFER_BUFFER_SIZE];
+    size_t length = 0;
+    bool sent = true;
+
+    for (int led = 0; led < dev.profile->leds; led++) {
+        uint8_t value = dev.leds_wanted[led].load(boost::memory_order_relaxed);
+        if (value == LED_UNKNOWN || value == dev.leds_shown[led]) {
+            continue;
+        }
+
+        if (length + 3 > sizeof(buf)) {
+            sent = write_automap_leds(dev, buf, length) && sent;
+            length = 0;
+        }
+
+        buf[length++] = 0xb0;
+        buf[length++] = led;
+        buf[length++] = value;
+    }
+
+    if (length) {
+        sent = write_automap_leds(dev, buf, length) && sent;
+    }
+
+    if (!sent) {
+        // whatever was not sent still differs from leds_shown
+        dev.leds_dirty.store(true, boost::memory_order_release);
+    }
+    return sent;
+}
+
+void manipulate_automap(midi_message_t& msg, midi_queue_t& queue)
+{
+    device_t& dev = *(device_t *)queue.owner;
+    note_tracker_t& notes = &queue == &dev.controller_queue ? dev.controller_notes : dev.midi_notes;
+    uint8_t status  = msg.buffer[0];
+    uint8_t channel = status & 0x0f;
+
+    // a note on with velocity 0 is a note off, and goes out at the pitch
+    // its note on went out at, whatever the octave is by now
+    if (IS_NOTE_OFF(status) || (IS_NOTE_ON(status) && msg.buffer[2] == 0)) {
+        uint8_t pitch = note_tracker_off(notes, channel, msg.buffer[1]);
+        if (pitch == NOTE_DROP) {
+            // its note was released by a panic already
+            msg.size = 0;
+            return;
+        }
+        msg.buffer[1] = pitch;
+    } else if (IS_NOTE_ON(status)) {
+        uint8_t pitch = msg.buffer[1];
+        if (dev.state == LISTEN) {
+            pitch = clamp_to((int)(pitch + dev.automap_octave * 12), 0, 127);
+        }
+        note_tracker_on(notes, channel, msg.buffer[1], pitch);
+        msg.buffer[1] = pitch;
+    } else if (IS_CONTROL_CHANGE(status) &&
+               (msg.buffer[1] == CC_ALL_SOUND_OFF || msg.buffer[1] == CC_ALL_NOTES_OFF)) {
+        note_tracker_clear_channel(notes, channel);
+    } else if (dev.state == LISTEN &&
+               &queue == &dev.controller_queue &&
+               msg.buffer[0] == 0xb0 &&
+               msg.buffer[1] >= 0    &&
+               msg.buffer[1] <= 9) {
+        // 8 rotary touch encoders
+        // add 0x10 so that the second does not conflict
+        // with modwheel
+        msg.buffer[1] += 0x10;
+    }
+}
+
+// note offs straight into a queue, bypassing parser and hooks.
+// Only on the thread producing the queue.
+struct queue_release_t {
+    midi_queue_t& queue;
+    uint64_t time;
+
+    void operator()(uint8_t channel, uint8_t pitch)
+    {
+        midi_message_t msg;
+        msg.time      = time;
+        msg.sysex     = 0;
+        msg.size      = 3;
+        msg.buffer[0] = 0x80 | channel;
+        msg.buffer[1] = pitch;
+        msg.buffer[2] = 0;
+        enqueue(queue, msg);
+    }
+};
+
+int release_notes(note_tracker_t& notes, midi_queue_t& queue, uint64_t time)
+{
+    queue_release_t release = { queue, time };
+    return note_tracker_flush(notes, release);
+}
+
+// The thread delivering controller messages (JACK process(), or the controller
+// thread without periods) only reads the current table, and bumps mapping_epoch
+// before and after: it is odd while a table may be in use. A table replaced by a
+// reload is only freed once the epoch shows the reader let go of it.
+boost::atomic<mapping_table_t *> mapping;
+boost::atomic<unsigned long> mapping_epoch;
+mapping_table_t *retired_mapping = NULL;
+unsigned long retired_epoch;
+
+// main thread, while a reload waits for the reader
+#define MAPPING_RETIRE_POLL_USECS 1000
+
+BOOST_STATIC_ASSERT(MAPPING_MAX_ACTIONS <= OSC_COALESCE_SLOTS);
+
+osc_arg_t mapping_arg(device_t& dev, mapping_action_t *action, int i, midi_message_t& msg)
+{
+    osc_arg_t arg = action->args[i];
+
+    switch (action->sources[i]) {
+    case ARG_VALUE:
+        arg.i = msg.buffer[2];
+        break;
+    case ARG_GAIN:
+        arg.f = 2.0 * ((float)msg.buffer[2])/127.0;
+        break;
+    case ARG_STATE:
+        arg.i = dev.toggle_states[msg.buffer[0] & 0x7f][msg.buffer[1]];
+        break;
+    default:
+        break;
+    }
+
+    return arg;
+}
+
+void process_controller_out_message(device_t& dev, midi_message_t& msg)
+{
+    if (msg.size != 3 || msg.buffer[0] < 0x80) {
+        return;
+    }
+
+    mapping_epoch++;
+    mapping_table_t *table = mapping.load();
+    uint8_t status = msg.buffer[0] & 0x7f;
+    uint8_t data1  = msg.buffer[1];
+
+    bool encoder = false;
+
+    for (mapping_action_t *action = mapping_first(table, msg.buffer[0], data1); action; action = mapping_next(table, action)) {
+        if (action->press && !msg.buffer[2]) {
+            continue;
+        }
+
+        switch (action->type) {
+        case ACTION_ENCODER: {
+            int value = msg.buffer[2];
+            if (64 <= value && value <= 127) {
+                value = value - 128;
+            }
+            dev.control_values[status][data1] = clamp_to((int)dev.control_values[status][data1] + value, 0, 127);
+            msg.buffer[2] = dev.control_values[status][data1];
+            encoder = true;
+            break;
+        }
+
+        case ACTION_BUTTON:
+            msg.buffer[2] = msg.buffer[2] ? 127 : 0;
+            break;
+
+        case ACTION_TOGGLE:
+            dev.toggle_states[status][data1] ^= 1;
+            if (!action->path[0]) {
+                break;
+            }
+            // fall through and send the new state
+
+        case ACTION_OSC:
+            if (ardour.target) {
+                osc_command_t command;
+                strcpy(command.path, action->path);
+                strcpy(command.types, action->types);
+                for (int i = 0; action->types[i]; i++) {
+                    command.args[i] = mapping_arg(dev, action, i, msg);
+                }
+
+                if (encoder) {
+                    osc_coalesce(dev.encoder_osc, action - table->actions, command);
+                } else {
+                    osc_send_command(ardour, command);
+                }
+            }
+            break;
+
+        case ACTION_REMAP:
+            msg.buffer[0] = action->status;
+            msg.buffer[1] = action->data1;
+            break;
+
+        case ACTION_LED:
+            set_automap_led(dev, action->led, mapping_arg(dev, action, 0, msg).i);
+            break;
+        }
+    }
+    mapping_epoch++;
+}
+
+// false while the reader may still be inside the message it read the retired table for
+bool free_retired_mapping()
+{
+    if (retired_mapping && (retired_epoch & 1) && mapping_epoch.load() == retired_epoch) {
+        return false;
+    }
+
+    mapping_free(retired_mapping);
+    retired_mapping = NULL;
+    return true;
+}
+
+// runs on the main thread, after SIGHUP in ultranova4linux
+void reload_mapping_table()
+{
+    mapping_table_t *table = mapping_load(config.mapping_file);
+    if (!table) {
+        fprintf(stderr, "keeping the current mapping\n");
+        return;
+    }
+
+    // a reload right after the last one, the reader is rarely still at the same message
+    while (!free_retired_mapping()) {
+        usleep(MAPPING_RETIRE_POLL_USECS);
+    }
+
+    retired_mapping = mapping.exchange(table);
+    retired_epoch   = mapping_epoch.load();
+    free_retired_mapping();
+    fprintf(stderr, "mapping reloaded\n");
+}
+
+// just before the frontend passes a controller message on
+void deliver_controller_message(midi_message_t& msg, midi_queue_t& queue)
+{
+    device_t& dev = *(device_t *)queue.owner;
+    if (dev.state == LISTEN) {
+        process_controller_out_message(dev, msg);
+    }
+    flight_record(recorder, FLIGHT_TO_JACK_CONTROLLER, device_index(dev), queue.clock(), msg.buffer, msg.size);
+}
+
+void deliver_midi_message(midi_message_t& msg, midi_queue_t& queue)
+{
+    device_t& dev = *(device_t *)queue.owner;
+    flight_record(recorder, FLIGHT_TO_JACK_MIDI, device_index(dev), queue.clock(), msg.buffer, msg.size);
+}
+
+// runs on the thread of the frontend sending to the device
+void device_send(device_t& dev, bool controller, const uint8_t *bytes, size_t size, uint64_t time)
+{
+    flight_record(recorder, controller ? FLIGHT_TO_USB_CONTROLLER : FLIGHT_TO_USB_MIDI, device_index(dev),
+                  time, bytes, size);
+
+    // early or late, both are off
+    int64_t off = (int64_t)(usecs_now() - time);
+    latency_record(controller ? dev.controller_out_timing : dev.midi_out_timing, off < 0 ? -off : off);
+
+    transfer_pool_t& pool = controller ? dev.controller_out_pool : dev.midi_out_pool;
+    if (config.batch_out) {
+        transfer_pool_batch(pool, bytes, size);
+    } else {
+        transfer_pool_send(pool, bytes, size);
+    }
+}
+
+void device_send_done(device_t& dev, bool controller)
+{
+    if (config.batch_out) {
+        transfer_pool_flush(controller ? dev.controller_out_pool : dev.midi_out_pool);
+    }
+}
+
+// runs on the thread of the frontend sending to the device
+void device_schedule(device_t& dev, bool controller, const uint8_t *bytes, size_t size, uint64_t time)
+{
+    out_schedule(controller ? dev.controller_schedule : dev.midi_schedule, bytes, size, time);
+}
+
+void device_schedule_done()
+{
+    sem_post(&out_wakeup);
+}
+
+// out_send_due() output, the device is acquired
+struct device_output_t {
+    device_t& dev;
+    bool controller;
+
+    bool send(const uint8_t *bytes, size_t size, uint64_t deadline)
+    {
+        device_send(dev, controller, bytes, size, deadline);
+        return true;
+    }
+};
+
+// out thread: sends what is due, returns the next deadline, 0 for none
+uint64_t device_send_due(device_t& dev, bool controller, uint64_t now)
+{
+    out_scheduler_t& scheduler = controller ? dev.controller_schedule : dev.midi_schedule;
+    if (!out_next_deadline(scheduler)) {
+        return 0;
+    }
+
+    // what was meant for the device before it was unplugged is stale
+    if (!device_acquire(dev)) {
+        scheduler.overflows += out_discard(scheduler);
+        return 0;
+    }
+
+    device_output_t output = { dev, controller };
+    uint64_t next = out_send_due(scheduler, now, output);
+    device_send_done(dev, controller);
+    device_release(dev);
+    return next;
+}
+
+void *out_thread_main(void *arg)
+{
+    uint64_t next = 0;
+
+    while (!do_exit) {
+        uint64_t now = usecs_now();
+        if (!next) {
+            sem_wait(&out_wakeup);
+        } else if (next > now) {
+            // an absolute CLOCK_MONOTONIC deadline, which no change of the wall clock
+            // moves. The clock of the frontend may be another one, like JACK time.
+            uint64_t at = usecs_now == monotonic_usecs ? next : monotonic_usecs() + (next - now);
+            struct timespec deadline = monotonic_timespec(at);
+            if (sem_clockwait(&out_wakeup, CLOCK_MONOTONIC, &deadline) != 0 && errno == ETIMEDOUT) {
+                // woken by the timer, how late
+                now = usecs_now();
+                rt_thread_record_latency(out_thread, now > next ? now - next : 0);
+            }
+        }
+
+        now  = usecs_now();
+        next = 0;
+        for (int d = 0; d < device_count; d++) {
+            for (int controller = 0; controller <= (int)devices[d].profile->controller; controller++) {
+                uint64_t due = device_send_due(devices[d], controller, now);
+                if (due && (!next || due < next)) {
+                    next = due;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+template <bool controller>
+void device_period_done(device_t& dev)
+{
+    if (ardour.target) {
+        osc_coalescer_flush(dev.encoder_osc, ardour, usecs_now());
+    }
+
+    // LEDs set by the mapping
+    if (controller && dev.leds_dirty.load(boost::memory_order_relaxed)) {
+        sem_post(&controller_wakeup);
+    }
+}
+
+template void device_period_done<true>(device_t& dev);
+template void device_period_done<false>(device_t& dev);
+
+void driver_period_done()
+{
+    if (ardour.target) {
+        osc_sender_cycle_done(ardour);
+    }
+}
+
+bool buffer_equal(const uint8_t *expected, const uint8_t *actual, int length)
+{
+    int i;
+
+    for (i = 0; i < length; i++) {
+        if (expected[i] != actual[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void cb_controller_out(struct libusb_transfer *transfer)
+{
+    if (config.debug) {
+        fprintf(stderr, "cb_controller_out: ");
+        print_libusb_transfer(transfer);
+    }
+    transfer_pool_release(transfer);
+}
+
+void cb_midi_out(struct libusb_transfer *transfer)
+{
+    if (config.debug) {
+        fprintf(stderr, "cb_midi_out: ");
+        print_libusb_transfer(transfer);
+    }
+    transfer_pool_release(transfer);
+}
+
+void cb_controller_in(struct libusb_transfer *transfer)
+{
+    uint64_t controller_in_t = usecs_now();
+    in_transfers_completed(transfer, controller_in_t);
+    device_t& dev = *(device_t *)((in_transfers_t *)transfer->user_data)->owner;
+
+    if (config.debug) {
+        fprintf(stderr, "%s cb_controller_in (%s): ", dev.name, state_names[dev.state]);
+        print_libusb_transfer(transfer);
+    }
+
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+        dev.left = true;
+        return;
+    }
+    flight_record(recorder, FLIGHT_USB_CONTROLLER, device_index(dev), controller_in_t,
+                  transfer->buffer, transfer->actual_length);
+
+    // hand the payload to the controller thread, so that Automap
+    // handling never holds up the keyboard MIDI endpoint
+    usb_packet_t packet;
+    packet.time   = controller_in_t;
+    packet.length = transfer->actual_length;
+    memcpy(packet.buffer, transfer->buffer, transfer->actual_length);
+    if (dev.controller_packets.push(packet)) {
+        sem_post(&controller_wakeup);
+    } else {
+        dev.controller_packet_overflows++;
+    }
+
+    in_transfers_resubmit(transfer, usecs_now());
+}
+
+// runs on the controller thread
+void process_controller_in(device_t& dev, usb_packet_t& packet)
+{
+    midi_input_t& input = dev.controller_input;
+    midi_message_t& msg = input.msg;
+
+    if (packet.length == sizeof(automap_button_press_in) &&
+       buffer_equal(automap_ok, packet.buffer, sizeof(automap_button_press_in))) {
+        dev.state = AUTOMAP_PRESSED;
+        fprintf(stderr, "%s: AUTOMAP PRESSED\n", dev.name);
+    }
+
+    switch(dev.state) {
+    case STARTUP:
+        if (packet.length == sizeof(automap_ok) &&
+           buffer_equal(automap_ok, packet.buffer, sizeof(automap_ok))) {
+            dev.state = LISTEN;
+            forget_automap_leds(dev);
+            if (dev.reconnects) {
+                fprintf(stderr, "%s: Automap handshake done %.1f ms after the transfers were submitted again\n",
+                        dev.name, (packet.time - dev.armed_at) / 1000.0);
+            }
+        } else if (packet.length == sizeof(automap_off) &&
+                  buffer_equal(automap_off, packet.buffer, sizeof(automap_off))) {
+            dev.state = WAIT_FOR_AUTOMAP;
+        } else {
+            fprintf(stderr, "%s: state STARTUP, got unexpected reply\n", dev.name);
+            fflush(stderr);
+        }
+        break;
+
+    case WAIT_FOR_AUTOMAP:
+        if (packet.length == sizeof(automap_ok) &&
+           buffer_equal(automap_ok, packet.buffer, sizeof(automap_ok))) {
+            dev.state = LISTEN;
+            forget_automap_leds(dev);
+
+            transfer_pool_send(dev.controller_out_pool, automap_ok, sizeof(automap_ok));
+            transfer_pool_send(dev.controller_out_pool, dev.profile->greeting, dev.profile->greeting_size);
+        }
+        break;
+
+    case AUTOMAP_PRESSED:
+        dev.state = LISTEN;
+        break;
+
+    case LISTEN:
+        if (packet.length == sizeof(automap_off) &&
+           buffer_equal(automap_off, packet.buffer, sizeof(automap_off))) {
+            dev.state = WAIT_FOR_AUTOMAP;
+        } else {
+            process_incoming(packet.buffer, packet.length, packet.time, input, dev.controller_queue);
+            int previous_octave = dev.automap_octave;
+            int octave = previous_octave;
+            const device_profile_t& profile = *dev.profile;
+            if (is(msg, profile.button_octave_minus)) octave -= 1;
+            if (is(msg, profile.button_octave_plus))  octave += 1;
+            octave = clamp_to(octave, -4, +4);
+            dev.automap_octave = octave;
+            if (octave != previous_octave && config.octave_panic) {
+                release_notes(dev.controller_notes, dev.controller_queue, packet.time);
+                dev.notes_panic = true;
+                // get the USB thread out of the event handler
+                libusb_interrupt_event_handler(ctx);
+            }
+            if (octave  > 0)   set_automap_led(dev, profile.led_octave_plus, 1);
+            if (octave == 0) { set_automap_led(dev, profile.led_octave_plus, 0); set_automap_led(dev, profile.led_octave_minus, 0); }
+            if (octave  < 0)   set_automap_led(dev, profile.led_octave_minus, 1);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (input.parser.size || input.parser.sysex) {
+        fprintf(stderr, "%s: pending controller message size: %d\n\n", dev.name,
+                input.parser.sysex ? input.sysex.size : input.parser.size);
+    }
+}
+
+// LED changes which found the OUT transfers in flight are sent again this much later
+#define LED_RETRY_USECS 1000
+
+void *controller_thread_main(void *arg)
+{
+    usb_packet_t packet;
+    bool osc_pending = false;
+    bool leds_pending = false;
+
+    while (!do_exit) {
+        if (osc_pending || leds_pending) {
+            // without periods nobody else wakes us for encoder updates held back by --osc-rate,
+            // and nobody at all for LED changes which could not be sent
+            uint64_t wait = config.encoder_osc_interval;
+            if (leds_pending && (!osc_pending || LED_RETRY_USECS < wait)) {
+                wait = LED_RETRY_USECS;
+            }
+            struct timespec deadline = monotonic_timespec(monotonic_usecs() + wait);
+            sem_clockwait(&controller_wakeup, CLOCK_MONOTONIC, &deadline);
+        } else {
+            sem_wait(&controller_wakeup);
+        }
+        osc_pending  = false;
+        leds_pending = false;
+
+        for (int d = 0; d < device_count; d++) {
+            device_t& dev = devices[d];
+            if (!dev.profile->controller) {
+                continue;
+            }
+
+            // anything left from before the device was unplugged is stale
+            if (!device_acquire(dev)) {
+                while (dev.controller_packets.pop(packet)) {
+                }
+                continue;
+            }
+
+            // the first packet was posted right after it had been stamped
+            bool first = true;
+            while (dev.controller_packets.pop(packet)) {
+                if (first) {
+                    rt_thread_record_latency(controller_thread, usecs_now() - packet.time);
+                    first = false;
+                }
+                process_controller_in(dev, packet);
+            }
+
+            // without periods, controller messages and their mapping go out right here
+            if (drain_device_queue) {
+                drain_device_queue(dev, dev.controller_queue);
+                if (ardour.target) {
+                    osc_coalescer_flush(dev.encoder_osc, ardour, usecs_now());
+                    osc_pending |= dev.encoder_osc.dirty_count > 0;
+                }
+            }
+
+            leds_pending |= !flush_automap_leds(dev);
+            device_release(dev);
+        }
+
+        if (drain_device_queue && ardour.target) {
+            osc_sender_cycle_done(ardour);
+        }
+    }
+
+    return NULL;
+}
+
+void cb_midi_in(struct libusb_transfer *transfer)
+{
+    uint64_t midi_in_t = usecs_now();
+    in_transfers_completed(transfer, midi_in_t);
+    device_t& dev = *(device_t *)((in_transfers_t *)transfer->user_data)->owner;
+
+    if (config.debug) {
+        fprintf(stderr, "%s cb_midi_in (%s): ", dev.name, state_names[dev.state]);
+        print_libusb_transfer(transfer);
+    }
+
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+        dev.left = true;
+        return;
+    }
+    flight_record(recorder, FLIGHT_USB_MIDI, device_index(dev), midi_in_t,
+                  transfer->buffer, transfer->actual_length);
+
+    midi_input_t& input = dev.midi_input;
+
+    process_incoming(transfer->buffer, transfer->actual_length, midi_in_t, input, dev.midi_queue);
+    if (drain_device_queue) {
+        drain_device_queue(dev, dev.midi_queue);
+    }
+
+    if ((input.parser.size || input.parser.sysex) && config.debug) {
+        fprintf(stderr, "%s: pending midi message size: %d\n\n", dev.name,
+                input.parser.sysex ? input.sysex.size : input.parser.size);
+    }
+
+    in_transfers_resubmit(transfer, usecs_now());
+}
+
+#define USB_EVENT_TIMEOUT_USECS 100000
+// how often an unplugged device is checked for senders still inside
+#define LEAVING_POLL_USECS 1000
+
+uint64_t service_devices();
+
+void *usb_thread_main(void *arg)
+{
+    struct timeval timeout;
+    // when thinning holds back a value which is due, or a device is leaving
+    uint64_t thin_due = 0;
+
+    while (!do_exit) {
+        uint64_t wait = USB_EVENT_TIMEOUT_USECS;
+        if (thin_due) {
+            uint64_t now = usecs_now();
+            if (thin_due <= now) {
+                wait = 0;
+            } else if (thin_due - now < wait) {
+                wait = thin_due - now;
+            }
+        }
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = wait;
+
+        uint64_t start = usecs_now();
+        int r = libusb_handle_events_timeout_completed(ctx, &timeout, NULL);
+        if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED){   // negative values are errors
+            fprintf(stderr, "libusb event handling failed: %s\n", libusb_error_name(r));
+            failed  = true;
+            do_exit = true;
+            if (config.on_failure) {
+                config.on_failure();
+            }
+            break;
+        }
+
+        // if we woke up because of the timeout, whatever its length, everything
+        // beyond it is latency of the scheduler. An event wakeup has no time
+        // to measure against, the completion is only stamped once we run.
+        uint64_t elapsed = usecs_now() - start;
+        if (elapsed >= wait) {
+            rt_thread_record_latency(usb_thread, elapsed - wait);
+        }
+
+        thin_due = service_devices();
+    }
+
+    return NULL;
+}
+
+void print_latency_stats()
+{
+    for (int d = 0; d < device_count; d++) {
+        midi_queue_t *queues[] = { &devices[d].midi_queue, &devices[d].controller_queue };
+        const char *names[]    = { "midi", "controller" };
+
+        for (int q = 0; q < 2; q++) {
+            latency_stats_t& latency = queues[q]->latency;
+            if (!latency.total.count) {
+                continue;
+            }
+            fprintf(stderr, "%s %s latency:\n", devices[d].name, names[q]);
+            latency_print(latency.parse,    "parse");
+            latency_print(latency.queue,    "queue");
+            latency_print(latency.delivery, "delivery");
+            latency_print(latency.total,    "total");
+            if (latency.timing.count) {
+                fprintf(stderr, "%s %s timing error (%s):\n", devices[d].name, names[q],
+                        config.fixed_latency ? "fixed latency" : "lowest latency");
+                latency_print(latency.timing, "timing");
+            }
+        }
+
+        latency_histogram_t *timings[] = { &devices[d].midi_out_timing, &devices[d].controller_out_timing };
+        for (int q = 0; q < 2; q++) {
+            if (!timings[q]->count) {
+                continue;
+            }
+            fprintf(stderr, "%s %s to USB, %s:\n", devices[d].name, names[q],
+                    config.schedule_out ? "scheduled" : "sent at once");
+            latency_print(*timings[q], "timing");
+        }
+    }
+}
+
+void print_sysex_stats(device_t& dev, const char *name, midi_input_t& input, midi_queue_t& queue)
+{
+    if (!input.parser.sysex_messages) {
+        return;
+    }
+
+    uint64_t usecs = input.sysex_last - input.sysex_first;
+    fprintf(stderr, "%s sysex %s: %lu messages, %.1f KB received at %.1f KB/s, %lu delivered, "
+            "buffer use max %u of %u KB, waited for port buffer room %lu times, "
+            "%lu fragments, %lu too large for the port buffer dropped\n",
+            dev.name, name, input.parser.sysex_messages, input.parser.sysex_bytes / 1024.0,
+            usecs ? input.parser.sysex_bytes * 1000000.0 / 1024.0 / usecs : 0.0,
+            queue.sysex_delivered, queue.sysex.max_used / 1024, queue.sysex.size / 1024,
+            queue.sysex_carried, queue.sysex_fragments, queue.sysex_oversize);
+}
+
+// every supported model
+device_profile_t device_profiles[] = {
+    device_profile<ultranova_profile_t>(),
+    device_profile<mininova_profile_t>(),
+};
+
+// NULL if the device is none of them
+const device_profile_t *find_profile(struct libusb_device_descriptor& descriptor)
+{
+    if (descriptor.idVendor != NOVATION_VENDOR_ID) {
+        return NULL;
+    }
+    for (size_t p = 0; p < sizeof(device_profiles) / sizeof(device_profiles[0]); p++) {
+        if (device_profiles[p].product_id == descriptor.idProduct) {
+            return &device_profiles[p];
+        }
+    }
+    return NULL;
+}
+
+bool device_claim(device_t& dev, libusb_device *usb_device);
+
+// claim the interfaces of a matching device and name it, false if it is not usable
+bool device_open(device_t& dev, libusb_device *usb_device, const device_profile_t *profile)
+{
+    dev.profile = profile;
+
+    int same_model = 1;
+    for (int d = 0; d < device_count; d++) {
+        if (devices[d].profile == dev.profile) {
+            same_model++;
+        }
+    }
+    if (same_model == 1) {
+        snprintf(dev.name, sizeof(dev.name), "%s", dev.profile->name);
+    } else {
+        snprintf(dev.name, sizeof(dev.name), "%s_%d", dev.profile->name, same_model);
+    }
+
+    return device_claim(dev, usb_device);
+}
+
+// open the device and claim its interfaces, on startup and when it is plugged in again
+bool device_claim(device_t& dev, libusb_device *usb_device)
+{
+    if (libusb_open(usb_device, &dev.devh) < 0) {
+        fprintf(stderr, "%s: cannot open device\n", dev.name);
+        dev.devh = NULL;
+        return false;
+    }
+
+    //claim the interfaces
+    bool success = true;
+    for (int i = 0; success && (dev.profile->interfaces >> i); i++) {
+        if (dev.profile->interfaces & (1 << i)) {
+            success = libusb_claim_interface(dev.devh, i) >= 0;
+        }
+    }
+
+    if (!success) {
+        fprintf(stderr, "%s: usb_claim_interface error\n", dev.name);
+        libusb_close(dev.devh);
+        dev.devh = NULL;
+        return false;
+    }
+
+    fprintf(stderr, "%s: claimed interface\n", dev.name);
+    return true;
+}
+
+// everything but the USB handle, before the frontend starts using the device
+bool device_init(device_t& dev)
+{
+    if (!midi_queue_init(dev.midi_queue, config.sysex_buffer_size, usecs_now) ||
+        !midi_queue_init(dev.controller_queue, config.sysex_buffer_size, usecs_now)) {
+        fprintf(stderr, "%s: cannot allocate %u bytes for sysex\n", dev.name, config.sysex_buffer_size);
+        return false;
+    }
+    dev.midi_queue.owner             = &dev;
+    dev.controller_queue.owner       = &dev;
+    dev.midi_queue.on_parsed          = manipulate_automap;
+    dev.controller_queue.on_parsed    = manipulate_automap;
+    dev.controller_queue.on_delivered = deliver_controller_message;
+    dev.midi_queue.on_delivered       = deliver_midi_message;
+    dev.midi_queue.sysex_split        = config.sysex_split;
+    dev.controller_queue.sysex_split  = config.sysex_split;
+    dev.midi_queue.fixed_latency       = config.fixed_latency;
+    dev.controller_queue.fixed_latency = config.fixed_latency;
+    if (config.schedule_out &&
+        (!out_scheduler_init(dev.midi_schedule, config.sysex_buffer_size) ||
+         !out_scheduler_init(dev.controller_schedule, config.sysex_buffer_size))) {
+        fprintf(stderr, "%s: cannot allocate %u bytes for scheduled sysex\n", dev.name, config.sysex_buffer_size);
+        return false;
+    }
+    memcpy(dev.midi_thinning.rules, config.thin_rules, sizeof(config.thin_rules));
+    for (int type = 0; type < THIN_TYPES; type++) {
+        if (config.thin_rules[type].window) {
+            dev.midi_queue.thinning = &dev.midi_thinning;
+        }
+    }
+
+    dev.state = STARTUP;
+    for (int led = 0; led < AUTOMAP_LEDS; led++) {
+        dev.leds_wanted[led] = LED_UNKNOWN;
+    }
+    forget_automap_leds(dev);
+    dev.encoder_osc.min_interval = config.encoder_osc_interval;
+
+    // the frontend sends through these, so set them up before it starts
+    if (!transfer_pool_init(dev.midi_out_pool, dev.devh, dev.profile->midi_endpoint_out, cb_midi_out) ||
+        (dev.profile->controller &&
+         !transfer_pool_init(dev.controller_out_pool, dev.devh, dev.profile->controller_endpoint_out, cb_controller_out))) {
+        fprintf(stderr, "%s: failed to allocate OUT transfers\n", dev.name);
+        return false;
+    }
+
+    return true;
+}
+
+// submit the IN transfers and start the Automap handshake
+void device_arm(device_t& dev)
+{
+    //submit the transfers, all following transfers are initiated from the CB
+    if (dev.profile->controller) {
+        in_transfers_submit(dev.controller_transfers_in);
+    }
+    in_transfers_submit(dev.midi_transfers_in);
+
+    if (dev.profile->controller) {
+        transfer_pool_send(dev.controller_out_pool, automap_ok, sizeof(automap_ok));
+    }
+}
+
+// once the frontend is ready: the IN transfers the device talks to the callbacks
+// through. false if they could not be allocated, device_close() frees what was.
+bool device_start(device_t& dev)
+{
+    if ((dev.profile->controller &&
+         !in_transfers_init(dev.controller_transfers_in, config.in_transfer_count, dev.devh,
+                            dev.profile->controller_endpoint_in, dev.profile->controller_packet_size, cb_controller_in)) ||
+        !in_transfers_init(dev.midi_transfers_in, config.in_transfer_count, dev.devh,
+                           dev.profile->midi_endpoint_in, LEN_IN_BUFFER, cb_midi_in)) {
+        fprintf(stderr, "%s: failed to allocate IN transfers\n", dev.name);
+        return false;
+    }
+    dev.controller_transfers_in.owner = &dev;
+    dev.midi_transfers_in.owner = &dev;
+    return true;
+}
+
+// the handle only, transfers and the ports of the frontend are kept for a reconnect
+void device_release_handle(device_t& dev)
+{
+    for (int i = 0; dev.profile->interfaces >> i; i++) {
+        if (dev.profile->interfaces & (1 << i)) {
+            libusb_release_interface(dev.devh, i);
+        }
+    }
+
+    libusb_close(dev.devh);
+    dev.devh = NULL;
+}
+
+void device_close(device_t& dev)
+{
+    if (dev.devh) {
+        device_release_handle(dev);
+    }
+    if (dev.arrived) {
+        libusb_unref_device(dev.arrived);
+        dev.arrived = NULL;
+    }
+
+    transfer_pool_free(dev.controller_out_pool);
+    transfer_pool_free(dev.midi_out_pool);
+    in_transfers_free(dev.controller_transfers_in);
+    in_transfers_free(dev.midi_transfers_in);
+}
+
+// USB thread: the device is gone, stop sending to it. The senders still
+// inside are waited for by service_devices(), not here: they may have a
+// lower priority and run on the same CPU.
+void device_disconnect(device_t& dev)
+{
+    dev.connected = false;
+    dev.leaving   = true;
+}
+
+// USB thread: nobody sends any more, let whatever was playing on its ports stop
+void device_left(device_t& dev)
+{
+    dev.leaving = false;
+    dev.left_at = usecs_now();
+    fprintf(stderr, "%s: unplugged\n", dev.name);
+    flight_mark(recorder, device_index(dev), dev.left_at, "unplugged");
+
+    midi_input_t& input = dev.midi_input;
+    if (input.parser.sysex) {
+        sysex_abort(dev.midi_queue.sysex);
+    }
+    midi_parser_reset(input.parser);
+    release_notes(dev.midi_notes, dev.midi_queue, dev.left_at);
+    if (drain_device_queue) {
+        drain_device_queue(dev, dev.midi_queue);
+    }
+}
+
+// USB thread: the device is back, reuse transfers, queues and ports
+void device_reconnect(device_t& dev, libusb_device *usb_device)
+{
+    if (!device_claim(dev, usb_device)) {
+        return;
+    }
+
+    in_transfers_rebind(dev.midi_transfers_in, dev.devh);
+    transfer_pool_rebind(dev.midi_out_pool, dev.devh);
+    if (dev.profile->controller) {
+        in_transfers_rebind(dev.controller_transfers_in, dev.devh);
+        transfer_pool_rebind(dev.controller_out_pool, dev.devh);
+    }
+
+    // the controller thread keeps away from the device while it is disconnected
+    midi_input_t& input = dev.controller_input;
+    if (input.parser.sysex) {
+        sysex_abort(dev.controller_queue.sysex);
+    }
+    midi_parser_reset(input.parser);
+    note_tracker_reset(dev.controller_notes);
+    dev.state = STARTUP;
+    forget_automap_leds(dev);
+
+    dev.connected = true;
+    device_arm(dev);
+
+    dev.armed_at = usecs_now();
+    dev.reconnects++;
+    uint64_t outage    = dev.armed_at - dev.left_at;
+    uint64_t reconnect = dev.armed_at - dev.arrived_at;
+    if (outage > dev.max_outage_usecs) {
+        dev.max_outage_usecs = outage;
+    }
+    if (reconnect > dev.max_reconnect_usecs) {
+        dev.max_reconnect_usecs = reconnect;
+    }
+    flight_mark(recorder, device_index(dev), dev.armed_at, "reconnected");
+    fprintf(stderr, "%s: reconnected in %.1f ms, %.1f ms after it was unplugged\n",
+            dev.name, reconnect / 1000.0, outage / 1000.0);
+}
+
+int hotplug_callback(libusb_context *ctx, libusb_device *usb_device, libusb_hotplug_event event, void *user_data)
+{
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+        for (int d = 0; d < device_count; d++) {
+            if (devices[d].devh && libusb_get_device(devices[d].devh) == usb_device) {
+                devices[d].left = true;
+            }
+        }
+        return 0;
+    }
+
+    struct libusb_device_descriptor descriptor;
+    const device_profile_t *profile;
+    if (libusb_get_device_descriptor(usb_device, &descriptor) < 0 || !(profile = find_profile(descriptor))) {
+        return 0;
+    }
+
+    // the first unplugged device of the same model takes it
+    for (int d = 0; d < device_count; d++) {
+        device_t& dev = devices[d];
+        if (dev.profile == profile && (!dev.connected || dev.left) && !dev.arrived) {
+            dev.arrived    = libusb_ref_device(usb_device);
+            dev.arrived_at = usecs_now();
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "new %s ignored, restart to use it\n", profile->name);
+    return 0;
+}
+
+// USB thread, after the event handler returned: hotplug callbacks may not
+// open or close devices themselves, and the USB thread produces the midi queue
+// returns when it has to run again, 0 if only for USB events
+uint64_t service_devices()
+{
+    uint64_t thin_due = 0;
+
+    for (int d = 0; d < device_count; d++) {
+        device_t& dev = devices[d];
+
+        if (dev.midi_thinning.held_count) {
+            uint64_t due = thin_flush_queue(dev.midi_queue, usecs_now());
+            if (drain_device_queue) {
+                drain_device_queue(dev, dev.midi_queue);
+            }
+            if (due && (!thin_due || due < thin_due)) {
+                thin_due = due;
+            }
+        }
+
+        if (dev.notes_panic.exchange(false)) {
+            release_notes(dev.midi_notes, dev.midi_queue, usecs_now());
+            if (drain_device_queue) {
+                drain_device_queue(dev, dev.midi_queue);
+            }
+        }
+
+        if (dev.left) {
+            dev.left = false;
+            if (dev.connected) {
+                device_disconnect(dev);
+            }
+        }
+
+        if (dev.leaving) {
+            if (!dev.senders) {
+                device_left(dev);
+            } else {
+                // the current period of the frontend is done with it soon
+                uint64_t due = usecs_now() + LEAVING_POLL_USECS;
+                if (!thin_due || due < thin_due) {
+                    thin_due = due;
+                }
+            }
+        }
+
+        // the IN transfers come back with LIBUSB_TRANSFER_NO_DEVICE, the OUT ones with errors
+        if (dev.devh && !dev.connected && !dev.leaving &&
+            !dev.midi_transfers_in.in_flight && !dev.controller_transfers_in.in_flight &&
+            !dev.midi_out_pool.in_flight && !dev.controller_out_pool.in_flight) {
+            device_release_handle(dev);
+        }
+
+        if (dev.arrived && !dev.devh) {
+            device_reconnect(dev, dev.arrived);
+            libusb_unref_device(dev.arrived);
+            dev.arrived = NULL;
+        }
+    }
+
+    return thin_due;
+}
+
+void print_device_stats(device_t& dev)
+{
+    const char *name = dev.name;
+
+    print_sysex_stats(dev, "midi", dev.midi_input, dev.midi_queue);
+    print_sysex_stats(dev, "controller", dev.controller_input, dev.controller_queue);
+
+    if (dev.midi_queue.overflows || dev.controller_queue.overflows) {
+        fprintf(stderr, "%s dropped messages: midi: %lu, controller: %lu\n", name,
+                (unsigned long)dev.midi_queue.overflows, (unsigned long)dev.controller_queue.overflows);
+    }
+    for (int type = 0; type < THIN_TYPES; type++) {
+        if (dev.midi_thinning.offered[type]) {
+            fprintf(stderr, "%s thinning %s: %lu of %lu removed\n", name, thin_type_name(type),
+                    dev.midi_thinning.removed[type], dev.midi_thinning.offered[type]);
+        }
+    }
+    if (dev.midi_schedule.overflows || dev.controller_schedule.overflows) {
+        fprintf(stderr, "%s dropped scheduled messages: midi: %lu, controller: %lu\n", name,
+                (unsigned long)dev.midi_schedule.overflows, (unsigned long)dev.controller_schedule.overflows);
+    }
+    if (dev.midi_out_pool.exhausted || dev.controller_out_pool.exhausted) {
+        fprintf(stderr, "%s OUT transfer pool exhausted: midi: %lu, controller: %lu\n", name,
+                (unsigned long)dev.midi_out_pool.exhausted, (unsigned long)dev.controller_out_pool.exhausted);
+    }
+    fprintf(stderr, "%s USB IN (%d transfers): midi: %lu completions, %.1f bytes/s, %lu usecs max without pending transfer, "
+            "controller: %lu completions, %.1f bytes/s, %lu usecs max without pending transfer\n",
+            name, config.in_transfer_count,
+            dev.midi_transfers_in.completions, in_transfers_throughput(dev.midi_transfers_in),
+            (unsigned long)dev.midi_transfers_in.max_starved,
+            dev.controller_transfers_in.completions, in_transfers_throughput(dev.controller_transfers_in),
+            (unsigned long)dev.controller_transfers_in.max_starved);
+    if (dev.controller_packet_overflows) {
+        fprintf(stderr, "%s dropped controller packets: %lu\n", name, (unsigned long)dev.controller_packet_overflows);
+    }
+    if (dev.profile->controller) {
+        fprintf(stderr, "%s Automap LEDs: %lu requests, %lu changes sent in %lu writes\n", name,
+                (unsigned long)dev.led_requests, dev.led_changes, dev.led_writes);
+    }
+    if (ardour.target) {
+        fprintf(stderr, "%s encoder OSC updates: %lu sent, %lu merged\n", name,
+                dev.encoder_osc.flushed, dev.encoder_osc.merged);
+    }
+    if (dev.midi_out_pool.messages || dev.controller_out_pool.messages) {
+        fprintf(stderr, "%s to USB (%s): midi: %lu messages in %lu transfers, controller: %lu messages in %lu transfers\n",
+                name, config.batch_out ? "batched" : "unbatched",
+                (unsigned long)dev.midi_out_pool.messages, (unsigned long)dev.midi_out_pool.submitted,
+                (unsigned long)dev.controller_out_pool.messages, (unsigned long)dev.controller_out_pool.submitted);
+    }
+    if (dev.reconnects) {
+        fprintf(stderr, "%s reconnects: %lu, longest %.1f ms to reconnect, longest outage %.1f ms\n", name,
+                dev.reconnects, dev.max_reconnect_usecs / 1000.0, dev.max_outage_usecs / 1000.0);
+    }
+}
+
+bool driver_open(const driver_config_t& driver_config)
+{
+    config = driver_config;
+    sem_init(&controller_wakeup, 0, 0);
+    sem_init(&out_wakeup, 0, 0);
+    usecs_now = config.clock ? config.clock : monotonic_usecs;
+    drain_device_queue = config.drain;
+    usb_thread.priority        = config.usb_priority;
+    usb_thread.cpu             = config.usb_cpu;
+    controller_thread.priority = config.controller_priority;
+    controller_thread.cpu      = config.controller_cpu;
+    out_thread.priority        = config.out_priority;
+
+    mapping = mapping_load(config.mapping_file);
+    if (!mapping) {
+        return false;
+    }
+
+    if (config.recorder_size && !flight_recorder_open(recorder, config.recorder_file, config.recorder_size, usecs_now())) {
+        fprintf(stderr, "running without flight recorder\n");
+    }
+
+    //init libUSB
+    if (libusb_init(NULL) < 0) {
+        fprintf(stderr, "Failed to initialise libusb\n");
+        return false;
+    }
+    usb_initialized = true;
+
+    // open every Ultranova and Mininova there is
+    libusb_device **usb_devices;
+    ssize_t usb_device_count = libusb_get_device_list(ctx, &usb_devices);
+    for (ssize_t i = 0; i < usb_device_count && device_count < MAX_DEVICES; i++) {
+        struct libusb_device_descriptor descriptor;
+        const device_profile_t *profile;
+        if (libusb_get_device_descriptor(usb_devices[i], &descriptor) < 0 || !(profile = find_profile(descriptor))) {
+            continue;
+        }
+
+        if (device_open(devices[device_count], usb_devices[i], profile)) {
+            device_count++;
+        }
+    }
+    if (usb_device_count >= 0) {
+        libusb_free_device_list(usb_devices, 1);
+    }
+
+    if (!device_count) {
+        fprintf(stderr, "neither Novation Ultranova nor Novation Mininova found\n");
+        return false;
+    }
+    fprintf(stderr, "%d device%s, %lu KB of state each\n", device_count, device_count > 1 ? "s" : "",
+            (unsigned long)(sizeof(device_t) + (config.schedule_out ? 4 : 2) * config.sysex_buffer_size) / 1024);
+
+    bool success = true;
+    for (int d = 0; d < device_count; d++) {
+        any_controller |= devices[d].profile->controller;
+        success = device_init(devices[d]) && success;
+    }
+
+    // init OSC
+    if (any_controller && config.control_ardour) {
+        osc_sender_init(ardour, lo_address_new_from_url("osc.udp://localhost:3819/"));
+    }
+
+    return success;
+}
+
+bool driver_start()
+{
+    // nothing is submitted unless every device has its transfers
+    for (int d = 0; d < device_count; d++) {
+        if (!device_start(devices[d])) {
+            return false;
+        }
+    }
+    // from now on the devices talk to the callbacks
+    for (int d = 0; d < device_count; d++) {
+        devices[d].connected = true;
+        device_arm(devices[d]);
+    }
+
+    // unplugged devices are picked up again, without touching the frontend
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        fprintf(stderr, "libusb without hotplug support, unplugged devices stay away until restarted\n");
+    } else if (libusb_hotplug_register_callback(ctx,
+                   LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                   LIBUSB_HOTPLUG_NO_FLAGS, NOVATION_VENDOR_ID, LIBUSB_HOTPLUG_MATCH_ANY,
+                   LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &hotplug_handle) == LIBUSB_SUCCESS) {
+        hotplug = true;
+    } else {
+        fprintf(stderr, "cannot register hotplug callback\n");
+    }
+
+    osc_running        = ardour.target && rt_thread_start(osc_thread, osc_sender_main, &ardour);
+    controller_running = any_controller && rt_thread_start(controller_thread, controller_thread_main, NULL);
+    out_running        = config.schedule_out && rt_thread_start(out_thread, out_thread_main, NULL);
+    usb_running        = (controller_running || !any_controller) && (out_running || !config.schedule_out) &&
+                         rt_thread_start(usb_thread, usb_thread_main, NULL);
+    return usb_running;
+}
+
+void driver_stop()
+{
+    do_exit = true;
+    if (usb_running) {
+        pthread_join(usb_thread.thread, NULL);
+        usb_running = false;
+    }
+    if (controller_running) {
+        sem_post(&controller_wakeup);
+        pthread_join(controller_thread.thread, NULL);
+        controller_running = false;
+    }
+    if (out_running) {
+        sem_post(&out_wakeup);
+        pthread_join(out_thread.thread, NULL);
+        out_running = false;
+    }
+    if (osc_running) {
+        osc_sender_stop(ardour);
+        pthread_join(osc_thread.thread, NULL);
+        osc_running = false;
+    }
+}
+
+bool driver_failed()
+{
+    return failed;
+}
+
+void driver_close()
+{
+    if (hotplug) {
+        libusb_hotplug_deregister_callback(ctx, hotplug_handle);
+        hotplug = false;
+    }
+    for (int d = 0; d < device_count; d++) {
+        device_close(devices[d]);
+        midi_queue_free(devices[d].midi_queue);
+        midi_queue_free(devices[d].controller_queue);
+        out_scheduler_free(devices[d].midi_schedule);
+        out_scheduler_free(devices[d].controller_schedule);
+    }
+    if (usb_initialized) {
+        libusb_exit(NULL);
+        usb_initialized = false;
+    }
+
+    mapping_free(mapping);
+    mapping_free(retired_mapping);
+    mapping = NULL;
+    retired_mapping = NULL;
+    flight_recorder_close(recorder);
+    if (ardour.target) {
+        osc_sender_free(ardour);
+    }
+
+    // back to what driver_open() starts from
+    for (int d = 0; d < device_count; d++) {
+        devices[d].~device();
+        new (&devices[d]) device_t();
+    }
+    device_count   = 0;
+    any_controller = false;
+    do_exit        = false;
+    failed         = false;
+    rt_thread_reset_stats(usb_thread);
+    rt_thread_reset_stats(controller_thread);
+    rt_thread_reset_stats(osc_thread);
+    rt_thread_reset_stats(out_thread);
+    sem_destroy(&controller_wakeup);
+    sem_destroy(&out_wakeup);
+}
+
+void driver_print_stats()
+{
+    print_latency_stats();
+    for (int d = 0; d < device_count; d++) {
+        print_device_stats(devices[d]);
+    }
+
+    rt_thread_print_stats(usb_thread);
+    if (any_controller) {
+        rt_thread_print_stats(controller_thread);
+    }
+    if (config.schedule_out) {
+        rt_thread_print_stats(out_thread);
+    }
+    if (ardour.target) {
+        fprintf(stderr, "OSC: %lu messages sent, %lu bundles, %lu dropped\n",
+                ardour.messages, ardour.bundles, (unsigned long)ardour.overflows);
+    }
+}
+
+// debugging function to display libusb_transfer
+inline void print_libusb_transfer(struct libusb_transfer *p_t)
+{   
+    int i;
+    if (NULL == p_t) {
+        printf("No libusb_transfer...\n");
+    }
+    else {
+        printf("libusb_transfer structure:\n");
+        printf("status  = %x \n", p_t->status);
+        printf("flags   = %x \n", p_t->flags);
+        printf("endpoint= %x \n", p_t->endpoint);
+        printf("type    = %x \n", p_t->type);
+        printf("timeout = %d \n", p_t->timeout);
+        // length, and buffer are commands sent to the device
+        printf("length        = %d \n", p_t->length);
+        printf("actual_length = %d \n", p_t->actual_length);
+
+        for (i=0; i < p_t->actual_length; i++){
+            printf(" 0x%02x,", p_t->buffer[i]);
+        }
+        puts("\n\n");
+    }
+
+    fflush(stdout);
+    return;
+}
+
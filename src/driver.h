@@ -0,0 +1,271 @@
+/*
+ * the driver as a library: USB transport, MIDI parsing, Automap and
+ * mapping of every connected Ultranova and Mininova, without JACK or ALSA
+ *
+ * A frontend fills in a driver_config_t and calls driver_open() with it,
+ * which finds, claims and sets up the keyboards in devices[]. It then
+ * creates its ports for them and calls driver_start(). From then on the
+ * USB thread parses what the keyboards play into the midi_queue and the
+ * controller_queue of each device. A frontend with periods, like JACK,
+ * picks them up once per period with pickup_from_queue() and calls
+ * device_period_done(); one without sets config.drain and passes them on
+ * with drain_queue().
+ * What goes to a keyboard goes through device_send(), between
+ * device_acquire() and device_release(), or with schedule_out through
+ * device_schedule(), which holds it until its time has come.
+ * driver_stop() ends the threads, driver_print_stats() reports on them,
+ * and driver_close() undoes the rest, after which driver_open() may run
+ * again. devices[] and device_count are for the frontend to read only.
+ *
+ * main.cpp is such a frontend, on JACK or on ALSA.
+ */
+#ifndef DRIVER_H
+#define DRIVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/atomic.hpp>
+#include <libusb-1.0/libusb.h>
+
+#include "device_profile.h"
+#include "transfer_pool.h"
+#include "in_transfers.h"
+#include "rt_thread.h"
+#include "osc_sender.h"
+#include "mapping.h"
+#include "midi_queue.h"
+#include "midi_thinning.h"
+#include "out_scheduler.h"
+#include "note_tracker.h"
+#include "flight_recorder.h"
+
+typedef struct device device_t;
+
+// everything a frontend can set, driver_config_init() fills in the defaults
+typedef struct {
+    bool debug;
+    // pack all messages a frontend sends at once into as few USB transfers as possible
+    bool batch_out;
+    // release all held notes when the Automap octave changes
+    bool octave_panic;
+    // IN transfers kept in flight per endpoint
+    int in_transfer_count;
+    // send OSC to Ardour for mapped controls
+    bool control_ardour;
+    // NULL for the built-in mapping
+    const char *mapping_file;
+    // minimum usecs between OSC updates of an encoder, 0 for once per period
+    uint64_t encoder_osc_interval;
+    uint32_t sysex_buffer_size;
+    bool sysex_split;
+    // frontends with periods: place what the keyboards send exactly one period late
+    bool fixed_latency;
+    // thinning of the keyboard MIDI, per message type, all off by default
+    thin_rule_t thin_rules[THIN_TYPES];
+    // the flight recorder, a size of 0 turns it off
+    const char *recorder_file;
+    size_t recorder_size;
+    // the frontend hands events to device_schedule(), the out thread sends them
+    bool schedule_out;
+
+    // SCHED_FIFO priorities and CPUs of the driver threads, -1 for any CPU
+    int usb_priority;
+    int usb_cpu;
+    int controller_priority;
+    int controller_cpu;
+    int out_priority;
+
+    // all times are microseconds of this clock, NULL for CLOCK_MONOTONIC
+    uint64_t (*clock)();
+    // Set by frontends without periods: called on the thread which just queued
+    // messages, to pass them on right away. NULL when the frontend picks the
+    // queues up once per period.
+    void (*drain)(device_t& dev, midi_queue_t& queue);
+    // called on the USB thread when libusb fails and the driver stops by
+    // itself, to wake up the frontend. NULL for none.
+    void (*on_failure)();
+} driver_config_t;
+
+void driver_config_init(driver_config_t& config);
+
+// the clock of driver_config_t, from driver_open() on
+extern uint64_t (*usecs_now)();
+uint64_t monotonic_usecs();
+
+// state machine
+enum state_t {
+    STARTUP,
+    WAIT_FOR_AUTOMAP,
+    AUTOMAP_PRESSED,
+    LISTEN,
+};
+
+extern const char* state_names[];
+
+// raw controller endpoint payloads, from the USB thread to the controller thread
+typedef struct {
+    uint64_t time;
+    int length;
+    uint8_t buffer[IN_TRANSFER_BUFFER_SIZE];
+} usb_packet_t;
+
+#define LED_UNKNOWN  0xff
+
+// Every keyboard has its own transfers, queues and Automap state, its ports
+// belong to the frontend. One USB thread and one controller thread serve all of them.
+#define MAX_DEVICES 4
+
+struct device {
+    // ultranova, ultranova_2, mininova, ...
+    char name[16];
+    const device_profile_t *profile;
+    libusb_device_handle *devh;
+
+    // IN-coming transfers (IN to host PC from USB-device)
+    in_transfers_t controller_transfers_in;
+    in_transfers_t midi_transfers_in;
+
+    // OUT-going transfers (OUT from host PC to USB-device)
+    transfer_pool_t controller_out_pool;
+    transfer_pool_t midi_out_pool;
+
+    // with schedule_out: events waiting for their time, from the frontend to the out thread
+    out_scheduler_t controller_schedule;
+    out_scheduler_t midi_schedule;
+    // how far from its time each event went out, recorded by whoever sends
+    latency_histogram_t controller_out_timing;
+    latency_histogram_t midi_out_timing;
+
+    // USB to MIDI
+    midi_queue_t midi_queue;
+    midi_queue_t controller_queue;
+    midi_input_t midi_input;
+    midi_input_t controller_input;
+    // only the keyboard MIDI, the relative encoders must not lose steps
+    midi_thinning_t midi_thinning;
+
+    // raw controller endpoint payloads, from the USB thread to the controller thread
+    boost::lockfree::spsc_queue<usb_packet_t, boost::lockfree::capacity<256> > controller_packets;
+    boost::atomic<unsigned long> controller_packet_overflows;
+
+    // written by the controller thread, read by the USB and JACK threads
+    boost::atomic<state_t> state;
+    boost::atomic<int> automap_octave;
+    // notes held on the keyboard and on the controller endpoint, each
+    // only touched by the producer of its queue
+    note_tracker_t midi_notes;
+    note_tracker_t controller_notes;
+    // set by the controller thread, the USB thread releases the midi notes
+    boost::atomic<bool> notes_panic;
+
+    // Automap LEDs: what we want them to show, and what the device shows.
+    // Any thread may set an LED, the controller thread sends the differences
+    // to the device, all of them in one write.
+    boost::atomic<uint8_t> leds_wanted[AUTOMAP_LEDS];
+    uint8_t leds_shown[AUTOMAP_LEDS];
+    boost::atomic<bool> leds_dirty;
+
+    boost::atomic<unsigned long> led_requests;
+    unsigned long led_changes;
+    unsigned long led_writes;
+
+    // absolute positions of encoders and states of toggles, kept across mapping reloads
+    uint8_t control_values[128][128];
+    uint8_t toggle_states[128][128];
+
+    // OSC sent after an encoder action only carries the latest position
+    osc_coalescer_t encoder_osc;
+
+    // Cleared while the device is unplugged, its ports stay registered.
+    // The frontend and the controller thread only send between device_acquire()
+    // and device_release(), the USB thread only closes the handle when
+    // nobody is inside.
+    boost::atomic<bool> connected;
+    boost::atomic<int>  senders;
+
+    // set by the hotplug callback, handled by the USB thread once the
+    // event handler returned
+    bool left;
+    libusb_device *arrived;
+    // USB thread: no longer connected, waiting for the senders still inside
+    bool leaving;
+
+    // reconnects: unplugged, plugged in again, reclaimed and transfers
+    // submitted, and the Automap handshake done
+    unsigned long reconnects;
+    uint64_t left_at;
+    uint64_t arrived_at;
+    uint64_t armed_at;
+    uint64_t max_outage_usecs;
+    uint64_t max_reconnect_usecs;
+};
+
+extern device_t devices[MAX_DEVICES];
+extern int device_count;
+
+inline bool device_acquire(device_t& dev)
+{
+    dev.senders++;
+    if (dev.connected) {
+        return true;
+    }
+    dev.senders--;
+    return false;
+}
+
+inline void device_release(device_t& dev)
+{
+    dev.senders--;
+}
+
+inline int device_index(device_t& dev)
+{
+    return &dev - devices;
+}
+
+inline int clamp_to(int value, int from, int to)
+{
+    if (value > to) {
+        value = to;
+    }
+    if (value < from) {
+        value = from;
+    }
+    return value;
+}
+
+// false if no keyboard could be set up, driver_close() cleans up either way
+bool driver_open(const driver_config_t& config);
+// submits the IN transfers and starts the threads, false if either failed;
+// nothing is submitted when an IN transfer could not be allocated
+bool driver_start();
+void driver_stop();
+void driver_close();
+// whether the driver stopped by itself, because libusb failed
+bool driver_failed();
+
+// a message for the keyboard which should go out at time; the distance is
+// recorded. With batch_out it is only sent by device_send_done().
+void device_send(device_t& dev, bool controller, const uint8_t *bytes, size_t size, uint64_t time);
+void device_send_done(device_t& dev, bool controller);
+
+// with schedule_out: the same, sent by the out thread once time has come.
+// Times must not decrease, device_schedule_done() wakes the out thread.
+void device_schedule(device_t& dev, bool controller, const uint8_t *bytes, size_t size, uint64_t time);
+void device_schedule_done();
+
+// frontends with periods: after the queues of a device were picked up,
+// and once all devices are done. controller as in dev.profile.
+template <bool controller>
+void device_period_done(device_t& dev);
+void driver_period_done();
+
+// from any thread but a realtime one, like the main thread after a signal
+void reload_mapping_table();
+void print_latency_stats();
+// on exit
+void driver_print_stats();
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * flight recorder: the last N minutes of MIDI traffic in a memory mapped ring file
+ *
+ * Every USB payload and every event passed between JACK and USB is
+ * written as a fixed size record into a shared mapping of a file, which
+ * stays behind when the process ends or crashes. The next start keeps
+ * it as FILE.1 before it begins a new one. Recording is a fetch_add
+ * and a memcpy, no syscall, so it is always on. Any thread may record.
+ * tools/flight_dump reads the file.
+ *
+ * Each record carries the sequence number it was written under, set last,
+ * so a reader sees which records are complete and which were overwritten.
+ */
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <boost/atomic.hpp>
+#include <boost/static_assert.hpp>
+
+#define FLIGHT_MAGIC        "U4LFLT1"
+#define FLIGHT_DATA_SIZE    44
+// 256K records, an hour of busy playing
+#define FLIGHT_DEFAULT_SIZE (16 * 1024 * 1024)
+#define FLIGHT_DEFAULT_FILE "/dev/shm/ultranova4linux.flight"
+
+// what a record holds, to_jack and to_usb are the events passed on
+enum flight_kind_t {
+    FLIGHT_USB_MIDI = 1,
+    FLIGHT_USB_CONTROLLER,
+    FLIGHT_TO_JACK_MIDI,
+    FLIGHT_TO_JACK_CONTROLLER,
+    FLIGHT_TO_USB_MIDI,
+    FLIGHT_TO_USB_CONTROLLER,
+    // text, like unplugged or reconnected
+    FLIGHT_MARK,
+};
+
+typedef struct {
+    // index + 1 when complete, 0 while it is written
+    boost::atomic<uint64_t> sequence;
+    // usecs of the driver clock: JACK time with JACK, CLOCK_MONOTONIC with ALSA
+    uint64_t time;
+    uint8_t  kind;
+    uint8_t  device;
+    // of the whole payload, only the first FLIGHT_DATA_SIZE bytes are kept
+    uint16_t length;
+    uint8_t  data[FLIGHT_DATA_SIZE];
+} flight_record_t;
+
+BOOST_STATIC_ASSERT(sizeof(flight_record_t) == 64);
+BOOST_STATIC_ASSERT(sizeof(boost::atomic<uint64_t>) == sizeof(uint64_t));
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    // power of two
+    uint32_t capacity;
+    // records written so far
+    boost::atomic<uint64_t> next;
+    // driver clock usecs when recording started
+    uint64_t started;
+    uint8_t pad[32];
+} flight_header_t;
+
+BOOST_STATIC_ASSERT(sizeof(flight_header_t) == 64);
+
+typedef struct {
+    flight_header_t *header;
+    flight_record_t *records;
+    uint32_t mask;
+    size_t size;
+} flight_recorder_t;
+
+// size in bytes is rounded down to a power of two records
+inline bool flight_recorder_open(flight_recorder_t& recorder, const char *filename, size_t size, uint64_t now)
+{
+    memset(&recorder, 0, sizeof(recorder));
+
+    uint32_t capacity = 1;
+    while ((uint64_t)capacity * 2 * sizeof(flight_record_t) + sizeof(flight_header_t) <= size &&
+           capacity < 0x80000000U) {
+        capacity *= 2;
+    }
+    size = sizeof(flight_header_t) + (size_t)capacity * sizeof(flight_record_t);
+
+    // keep what the previous run recorded, it may have crashed
+    char previous[PATH_MAX];
+    snprintf(previous, sizeof(previous), "%s.1", filename);
+    if (rename(filename, previous) < 0 && errno != ENOENT) {
+        fprintf(stderr, "%s: cannot keep the previous recording as %s: %s\n", filename, previous, strerror(errno));
+    }
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(filename);
+        return false;
+    }
+    if (ftruncate(fd, size) < 0) {
+        perror(filename);
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(filename);
+        return false;
+    }
+
+    // fault every page in now and keep it, instead of on the first record in it
+    memset(map, 0, size);
+    if (mlock(map, size) < 0) {
+        fprintf(stderr, "%s: cannot lock the flight recorder in memory, recording may page fault: %s\n",
+                filename, strerror(errno));
+    }
+
+    recorder.header  = (flight_header_t *)map;
+    recorder.records = (flight_record_t *)(recorder.header + 1);
+    recorder.mask    = capacity - 1;
+    recorder.size    = size;
+
+    recorder.header->record_size = sizeof(flight_record_t);
+    recorder.header->capacity    = capacity;
+    recorder.header->started     = now;
+    memcpy(recorder.header->magic, FLIGHT_MAGIC, sizeof(FLIGHT_MAGIC));
+    return true;
+}
+
+inline void flight_recorder_close(flight_recorder_t& recorder)
+{
+    if (recorder.header) {
+        munmap(recorder.header, recorder.size);
+        recorder.header  = NULL;
+        recorder.records = NULL;
+    }
+}
+
+// any thread, does nothing if the recorder is not open
+inline void flight_record(flight_recorder_t& recorder, flight_kind_t kind, int device, uint64_t time,
+                          const uint8_t *data, size_t length)
+{
+    if (!recorder.records) {
+        return;
+    }
+
+    uint64_t index = recorder.header->next.fetch_add(1, boost::memory_order_relaxed);
+    flight_record_t& record = recorder.records[index & recorder.mask];
+
+    record.sequence.store(0, boost::memory_order_relaxed);
+    record.time   = time;
+    record.kind   = kind;
+    record.device = device;
+    record.length = length > 0xffff ? 0xffff : length;
+    memcpy(record.data, data, length < FLIGHT_DATA_SIZE ? length : FLIGHT_DATA_SIZE);
+    record.sequence.store(index + 1, boost::memory_order_release);
+}
+
+inline void flight_mark(flight_recorder_t& recorder, int device, uint64_t time, const char *text)
+{
+    flight_record(recorder, FLIGHT_MARK, device, time, (const uint8_t *)text, strlen(text));
+}
+
+#endif
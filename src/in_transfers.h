@@ -0,0 +1,131 @@
+/*
+ * a ring of IN transfers for one USB endpoint
+ *
+ * With a single IN transfer the endpoint has no URB pending while its
+ * completion is parsed and the transfer resubmitted, and whatever the
+ * keyboard sends in that window piles up in the device. Keeping several
+ * transfers in flight closes that gap. Transfers on one endpoint complete
+ * in the order they were submitted and all callbacks run on the USB event
+ * thread, so the parser still sees the bytes in order.
+ */
+#ifndef IN_TRANSFERS_H
+#define IN_TRANSFERS_H
+
+#include <stdint.h>
+#include <libusb-1.0/libusb.h>
+
+#define MAX_IN_TRANSFERS        8
+#define IN_TRANSFER_BUFFER_SIZE 32
+
+typedef struct {
+    struct libusb_transfer *transfers[MAX_IN_TRANSFERS];
+    uint8_t buffers[MAX_IN_TRANSFERS][IN_TRANSFER_BUFFER_SIZE];
+    int count;
+    // transfers currently submitted
+    int in_flight;
+    // for the callback, whoever set up the ring
+    void *owner;
+
+    // statistics, times in usecs
+    unsigned long completions;
+    unsigned long bytes;
+    uint64_t first_completion;
+    uint64_t last_completion;
+    // since when no transfer has been pending, and the longest such gap
+    uint64_t starved_since;
+    uint64_t max_starved;
+} in_transfers_t;
+
+// the callback has to pass every transfer to in_transfers_completed()
+// and in_transfers_resubmit(). On failure count holds the transfers
+// allocated so far, for in_transfers_free().
+inline bool in_transfers_init(in_transfers_t& ring, int count, libusb_device_handle *devh,
+                              int endpoint, int length, libusb_transfer_cb_fn callback)
+{
+    ring.count = 0;
+    for (int i = 0; i < count; i++) {
+        ring.transfers[i] = libusb_alloc_transfer(0);
+        if (!ring.transfers[i]) {
+            return false;
+        }
+        ring.count++;
+
+        libusb_fill_interrupt_transfer(ring.transfers[i], devh, endpoint,
+                                       ring.buffers[i], length,
+                                       callback, &ring, 0);
+    }
+
+    return true;
+}
+
+// only while none of them is in flight, libusb owns those until they complete
+inline void in_transfers_free(in_transfers_t& ring)
+{
+    if (ring.in_flight) {
+        return;
+    }
+
+    for (int i = 0; i < ring.count; i++) {
+        libusb_free_transfer(ring.transfers[i]);
+        ring.transfers[i] = NULL;
+    }
+    ring.count = 0;
+}
+
+inline void in_transfers_submit(in_transfers_t& ring)
+{
+    for (int i = 0; i < ring.count; i++) {
+        if (libusb_submit_transfer(ring.transfers[i]) >= 0) {
+            ring.in_flight++;
+        }
+    }
+}
+
+inline void in_transfers_completed(struct libusb_transfer *transfer, uint64_t now)
+{
+    in_transfers_t& ring = *(in_transfers_t *)transfer->user_data;
+
+    if (!ring.completions) {
+        ring.first_completion = now;
+    }
+    ring.last_completion = now;
+    ring.completions++;
+    ring.bytes += transfer->actual_length;
+
+    if (--ring.in_flight == 0) {
+        ring.starved_since = now;
+    }
+}
+
+inline void in_transfers_resubmit(struct libusb_transfer *transfer, uint64_t now)
+{
+    in_transfers_t& ring = *(in_transfers_t *)transfer->user_data;
+
+    if (ring.in_flight == 0 && now - ring.starved_since > ring.max_starved) {
+        ring.max_starved = now - ring.starved_since;
+    }
+
+    if (libusb_submit_transfer(transfer) >= 0) {
+        ring.in_flight++;
+    }
+}
+
+// after the device was plugged in again, with no transfer in flight
+inline void in_transfers_rebind(in_transfers_t& ring, libusb_device_handle *devh)
+{
+    for (int i = 0; i < ring.count; i++) {
+        ring.transfers[i]->dev_handle = devh;
+    }
+}
+
+// bytes per second over the time completions were seen
+inline double in_transfers_throughput(in_transfers_t& ring)
+{
+    if (ring.last_completion <= ring.first_completion) {
+        return 0.0;
+    }
+
+    return ring.bytes * 1000000.0 / (ring.last_completion - ring.first_completion);
+}
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * fixed bucket latency histograms
+ *
+ * One thread records, any other thread may print at the same time.
+ * Buckets are log-linear: exact below 16 usecs, above that each power
+ * of two is split into 16 buckets, so percentiles are within 1/16.
+ */
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <boost/atomic.hpp>
+
+#define LATENCY_SUB_BUCKETS 16
+// up to 2^32 usecs
+#define LATENCY_BUCKETS     ((32 - 3) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+    boost::atomic<uint32_t> buckets[LATENCY_BUCKETS];
+    boost::atomic<unsigned long> count;
+    boost::atomic<uint64_t> max;
+} latency_histogram_t;
+
+inline int latency_bucket(uint64_t usecs)
+{
+    if (usecs < LATENCY_SUB_BUCKETS) {
+        return usecs;
+    }
+    if (usecs > 0xffffffffULL) {
+        return LATENCY_BUCKETS - 1;
+    }
+
+    int exponent = 63 - __builtin_clzll(usecs);
+    int sub      = (usecs >> (exponent - 4)) & (LATENCY_SUB_BUCKETS - 1);
+    return (exponent - 3) * LATENCY_SUB_BUCKETS + sub;
+}
+
+// largest value which falls into bucket
+inline uint64_t latency_bucket_limit(int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int exponent = bucket / LATENCY_SUB_BUCKETS + 3;
+    int sub      = bucket % LATENCY_SUB_BUCKETS;
+    return ((uint64_t)(LATENCY_SUB_BUCKETS + sub + 1) << (exponent - 4)) - 1;
+}
+
+// recording thread only, negative latencies count as 0
+inline void latency_record(latency_histogram_t& histogram, int64_t usecs)
+{
+    if (usecs < 0) {
+        usecs = 0;
+    }
+
+    histogram.buckets[latency_bucket(usecs)].fetch_add(1, boost::memory_order_relaxed);
+    histogram.count.fetch_add(1, boost::memory_order_relaxed);
+    if ((uint64_t)usecs > histogram.max.load(boost::memory_order_relaxed)) {
+        histogram.max.store(usecs, boost::memory_order_relaxed);
+    }
+}
+
+// upper limit of the bucket holding the given fraction of the values
+inline uint64_t latency_percentile(latency_histogram_t& histogram, double fraction)
+{
+    unsigned long count = histogram.count.load(boost::memory_order_relaxed);
+    unsigned long wanted = (unsigned long)(count * fraction + 0.5);
+    if (wanted == 0) {
+        wanted = 1;
+    }
+
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += histogram.buckets[bucket].load(boost::memory_order_relaxed);
+        if (seen >= wanted) {
+            uint64_t limit = latency_bucket_limit(bucket);
+            uint64_t max   = histogram.max.load(boost::memory_order_relaxed);
+            return limit < max ? limit : max;
+        }
+    }
+
+    return histogram.max.load(boost::memory_order_relaxed);
+}
+
+inline void latency_print(latency_histogram_t& histogram, const char *name)
+{
+    unsigned long count = histogram.count.load(boost::memory_order_relaxed);
+    if (!count) {
+        return;
+    }
+
+    fprintf(stderr, "  %-10s %8lu events, p50 %6lu usecs, p99 %6lu usecs, max %6lu usecs\n",
+            name, count,
+            (unsigned long)latency_percentile(histogram, 0.50),
+            (unsigned long)latency_percentile(histogram, 0.99),
+            (unsigned long)histogram.max.load(boost::memory_order_relaxed));
+}
+
+#endif
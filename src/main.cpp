@@ -1,793 +1,597 @@
 /*
  * ultranova driver for linux
+ *
+ * The frontend: JACK ports, or ALSA sequencer ports with --alsa, for the
+ * keyboards served by the driver library, see driver.h.
  */
 
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <vector>
-#include <map>
-#include <queue>
-#include <boost/thread/mutex.hpp>
-#include <boost/assert.hpp>
-#include <libusb-1.0/libusb.h>
 #include <jack/jack.h>
 #include <jack/midiport.h>
-#include <lo/lo.h>
 
-#include "automap_protocol.h"
-
-#define USB_VENDOR_ID                0x1235
-#define ULTRANOVA_PRODUCT_ID         0x0011
-#define MININOVA_PRODUCT_ID          0x001e
-
-#define CONTROLLER_ENDPOINT_IN       (LIBUSB_ENDPOINT_IN  | 5)
-#define CONTROLLER_ENDPOINT_OUT      (LIBUSB_ENDPOINT_OUT | 5)
-#define ULTRANOVA_MIDI_ENDPOINT_IN   (LIBUSB_ENDPOINT_IN  | 3)
-#define ULTRANOVA_MIDI_ENDPOINT_OUT  (LIBUSB_ENDPOINT_OUT | 3)
-#define MININOVA_MIDI_ENDPOINT_IN    (LIBUSB_ENDPOINT_IN  | 1)
-#define MININOVA_MIDI_ENDPOINT_OUT   (LIBUSB_ENDPOINT_OUT | 2)
-
-int midi_endpoint_in  = ULTRANOVA_MIDI_ENDPOINT_IN;
-int midi_endpoint_out = ULTRANOVA_MIDI_ENDPOINT_OUT;
+#include "dll.h"
+#include "driver.h"
+#include "alsa_seq.h"
 
 using namespace std;
 
-static bool debug     = false;
-static bool ultranova = true;
+// the settings of the driver, from the command line
+driver_config_t config;
+// waits for signals, and for the driver to fail
+pthread_t main_thread;
 
-// controller state
-char encoder_states[10];
+// ALSA sequencer ports instead of a JACK client, with --alsa
+static bool use_alsa = false;
+alsa_seq_t alsa;
+// sequencer events from other clients to MIDI bytes, only used by the ALSA thread
+snd_midi_event_t *alsa_decoder;
+// reads events for the keyboards from the ALSA sequencer
+rt_thread_t alsa_thread = { "alsa", 70, -1 };
 
 // JACK stuff
 jack_client_t *client;
-jack_port_t *controller_out;
-jack_port_t *controller_in;
-jack_port_t *midi_out;
-jack_port_t *midi_in;
 jack_nframes_t nframes;
+jack_nframes_t sample_rate;
 
-struct timespec diff(struct timespec start, struct timespec end);
-struct timespec last_cycle;
-struct timespec cycle_period;
-
-struct timespec controller_in_t;
-struct timespec midi_in_t;
-
-#define SMALL_BUF_SIZE 4
-#define IS_AFTERTOUCH(a) (((a) & 0xf0) == 0xd0)
-#define IS_NOTE_ON(a)    (((a) & 0xf0) == 0x90)
-#define IS_NOTE_OFF(a)   (((a) & 0xf0) == 0x80)
-typedef struct {
-    struct timespec time;
-    vector<uint8_t> buffer;
-} midi_message_t;
-
-bool is(midi_message_t& msg, uint8_t *buf)
-{
-    for (int i = 0; i < 3; i++) {
-        if (msg.buffer[i] != buf[i]) return false;
-    }
-
-    return true;
-}
+// start of the previous cycle and filtered cycle length
+jack_time_t prev_cycle;
+double cycle_period;
 
-// USB to MIDI
-boost::mutex midi_mutex;
-queue<midi_message_t> midi_queue;
+// time spent forwarding JACK to USB, to compare batched against unbatched sending
+unsigned long jack_to_usb_cycles;
+jack_time_t   jack_to_usb_usecs;
+jack_time_t   jack_to_usb_max_usecs;
+// with --schedule-out: whether this period handed anything to the out thread
+bool jack_to_usb_scheduled;
 
-boost::mutex controller_mutex;
-queue<midi_message_t> controller_queue;
+// fallback for JACK versions without jack_get_cycle_times()
+#define DLL_BANDWIDTH 1.0
+dll_t cycle_dll;
+bool cycle_dll_running = false;
 
-// USB
-struct libusb_device_handle *devh = NULL;
-#define LEN_IN_BUFFER 32
-static uint8_t in_buffer_control[LEN_IN_BUFFER];
-static uint8_t in_buffer_midi[LEN_IN_BUFFER];
+volatile sig_atomic_t quit           = false;
+volatile sig_atomic_t reload_mapping = false;
+volatile sig_atomic_t print_latency  = false;
 
-#define CONTROLLER_MAXLENGTH 0x18
+// pickup_from_queue() output into a JACK port buffer
+struct jack_output_t {
+    void *buffer;
 
-// IN-coming transfers (IN to host PC from USB-device)
-struct libusb_transfer *controller_transfer_in = NULL;
-struct libusb_transfer *midi_transfer_in       = NULL;
+    size_t max_event_size()
+    {
+        return jack_midi_max_event_size(buffer);
+    }
 
-static libusb_context *ctx = NULL;
+    uint8_t *reserve(uint32_t frame, size_t size)
+    {
+        return jack_midi_event_reserve(buffer, frame, size);
+    }
+};
 
-// OSC
-lo_address ardour;
-uint8_t ardour_mute_states;
-uint8_t ardour_recen_states;
+// the ports of a device, JACK or ALSA
+typedef struct ports ports_t;
+
+struct ports {
+    // the JACK period of the device, returns the usecs spent sending to USB
+    jack_time_t (*process)(device_t& dev, ports_t& ports, jack_nframes_t nframes);
+
+    jack_port_t *controller_out;
+    jack_port_t *controller_in;
+    jack_port_t *midi_out;
+    jack_port_t *midi_in;
+
+    // the same with --alsa: outputs fed by the USB and the controller thread,
+    // and the ports other clients write to
+    alsa_output_t alsa_midi_out;
+    alsa_output_t alsa_controller_out;
+    int alsa_midi_in;
+    int alsa_controller_in;
+
+    // what the device costs the JACK thread
+    unsigned long process_cycles;
+    jack_time_t   process_usecs;
+    jack_time_t   process_max_usecs;
+};
 
-bool do_exit = false;
+ports_t ports[MAX_DEVICES];
 
 // Function Prototypes:
 void sighandler(int signum);
-void print_libusb_transfer(struct libusb_transfer *p_t);
-void cb_controller_out(struct libusb_transfer *transfer);
-void cb_midi_out(struct libusb_transfer *transfer);
-
-enum exitflag_t {
-    OUT_DEINIT,
-    OUT_RELEASE,
-    OUT
-} exitflag;
-
-// state machine
-enum state_t {
-    STARTUP,
-    WAIT_FOR_AUTOMAP,
-    AUTOMAP_PRESSED,
-    LISTEN,
-} state = STARTUP;
-
-const char* state_names[] = {
-    "STARTUP",
-    "WAIT_FOR_AUTOMAP",
-    "AUTOMAP_PRESSED",
-    "LISTEN",
-};
-
-int automap_octave = 0;
+void driver_failure();
+void sighup_handler(int signum);
+void sigusr1_handler(int signum);
 
-void set_automap_led(uint8_t led, uint8_t value)
+void jack_to_usb(void *jack_midi_buffer, device_t& dev, bool controller)
 {
-    static struct libusb_transfer *transfer = NULL;
-    transfer = libusb_alloc_transfer(0);
-    uint8_t buf[] = { 0xb0, led, value };
-
-    libusb_fill_interrupt_transfer(transfer, devh, CONTROLLER_ENDPOINT_OUT,
-                                   buf,
-                                   sizeof(buf),
-                                   cb_controller_out, NULL, 0);
-    libusb_submit_transfer(transfer);
-}
-
-size_t midi_event_size(uint8_t firstByte)
-{
-    size_t result = 3;
-
-    uint8_t firstNibble = firstByte & 0xf0;
-    if (firstNibble == 0xc0 ||
-        firstNibble == 0xd0 ||
-        firstByte == 0xf3) {
-        result = 2;
-    }
-
-    uint8_t secondNibble = 0x0f & firstByte;
-    if (firstNibble == 0xf0 &&
-        secondNibble != 0 &&
-        secondNibble != 2 &&
-        secondNibble != 3) {
-        result = 1;
+    jack_midi_event_t in_event;
+    jack_nframes_t event_index = 0;
+    jack_nframes_t event_count = jack_midi_get_event_count(jack_midi_buffer);
+    // the current cycle plays one period after the previous one
+    jack_time_t cycle_start = prev_cycle + (jack_time_t)cycle_period;
+
+    if (config.schedule_out) {
+        // like the audio of the period, each event goes out one period
+        // after its frame, so that all of them are still ahead
+        for (event_index = 0; event_index < event_count; event_index++) {
+            jack_midi_event_get(&in_event, jack_midi_buffer, event_index);
+            device_schedule(dev, controller, in_event.buffer, in_event.size,
+                            cycle_start + (jack_time_t)(cycle_period + in_event.time * cycle_period / nframes));
+        }
+        jack_to_usb_scheduled |= event_count > 0;
+        return;
     }
 
-    if (firstByte == 0xf0) {
-        return 0;
+    for (event_index = 0; event_index < event_count; event_index++) {
+        jack_midi_event_get(&in_event, jack_midi_buffer, event_index);
+        device_send(dev, controller, in_event.buffer, in_event.size,
+                    cycle_start + (jack_time_t)(in_event.time * cycle_period / nframes));
     }
 
-    return result;
+    device_send_done(dev, controller);
 }
 
-inline int clamp_to(int value, int from, int to)
+// find out when the current cycle started and how long it lasts,
+// using the DLL filtered times JACK keeps for its own clock
+bool update_cycle_times(jack_nframes_t nframes)
 {
-    if (value > to) {
-        value = to;
-    }
-    if (value < from) {
-        value = from;
+    jack_nframes_t current_frames;
+    jack_time_t current_usecs;
+    jack_time_t next_usecs;
+    float period_usecs;
+
+    if (jack_get_cycle_times(client, &current_frames, &current_usecs, &next_usecs, &period_usecs) == 0) {
+        cycle_period = period_usecs;
+        prev_cycle   = current_usecs - (jack_time_t)period_usecs;
+        return cycle_period > 0;
+    }
+
+    // no cycle times available, filter our own wakeup times instead
+    jack_time_t now = usecs_now();
+    double nominal_period = 1000000.0 * nframes / sample_rate;
+    if (!cycle_dll_running || fabs(now - cycle_dll.t1) > nominal_period) {
+        // first cycle or xrun, lock again
+        dll_init(cycle_dll, now, nominal_period, DLL_BANDWIDTH);
+        cycle_dll_running = true;
+    } else {
+        dll_update(cycle_dll, now);
     }
-    return value;
+
+    cycle_period = cycle_dll.t1 - cycle_dll.t0;
+    prev_cycle   = (jack_time_t)(cycle_dll.t0 - cycle_period);
+    return cycle_period > 0;
 }
 
-void manipulate_automap(midi_message_t& msg, queue<midi_message_t>& queue)
+int buffer_size_changed(jack_nframes_t new_nframes, void *arg)
 {
-    static std::map<uint8_t, uint8_t> dangling_notes;
-
-    if (state == LISTEN) {
-        uint8_t orig_note = msg.buffer[1];
-        uint8_t mangled_note = clamp_to((int)(orig_note + automap_octave * 12), 0, 127);
-
-        if (IS_NOTE_ON(msg.buffer[0])) {
-            dangling_notes[orig_note] = mangled_note;
-            msg.buffer[1] = mangled_note;
-        } else if (IS_NOTE_OFF(msg.buffer[0])) {
-            std::map<uint8_t, uint8_t>::iterator it = dangling_notes.find(orig_note);
-            if (it != dangling_notes.end()) {
-                msg.buffer[1] = it->second;
-                dangling_notes.erase(it);
-            }
-        } else if (&queue == &controller_queue &&
-                   msg.buffer[0] == 0xb0 &&
-                   msg.buffer[1] >= 0    &&
-                   msg.buffer[1] <= 9) {
-            // 8 rotary touch encoders
-            // add 0x10 so that the second does not conflict
-            // with modwheel
-            msg.buffer[1] += 0x10;
-        }
-    }
+    nframes = new_nframes;
+    // the period length changed, the DLL has to lock again
+    cycle_dll_running = false;
+    return 0;
 }
 
-
-#define AUTOMAP_ENCODERS 0xb0
-#define AUTOMAP_BUTTONS 0xb2
-void process_controller_out_message(midi_message_t& msg)
+// one device for one JACK period, specialized on whether it has the controller endpoint
+template <bool controller>
+jack_time_t process_device(device_t& dev, ports_t& port, jack_nframes_t nframes)
 {
-    if (msg.buffer[0] == AUTOMAP_ENCODERS && msg.buffer[1] >= 0x10 && msg.buffer[1] <= 0x19) {
-        int encoder_number = msg.buffer[1] - 0x10;
-        int value = msg.buffer[2];
-        if (64 <= value && value <= 127) {
-            value = value - 128;
-        }
-        encoder_states[encoder_number] = clamp_to((int)encoder_states[encoder_number] + value, 0, 127);
-        msg.buffer[2] = encoder_states[encoder_number];
-
-        if (ardour && encoder_number <= 8) {
-            int target_id = encoder_number == 8 ? 318 : encoder_number + 1;
-            lo_send(ardour, "/ardour/routes/gainabs", "if", target_id, 2.0 * ((float)msg.buffer[2])/127.0);
-        }
-    }
-
-    if (msg.buffer[0] == AUTOMAP_BUTTONS) {
-        msg.buffer[2] = msg.buffer[2] ? 127 : 0;
-        uint8_t value = msg.buffer[2];
-        uint8_t button = msg.buffer[1];
-
-        if (ardour) {
-            if (button <= 7 && value) {
-               if (value) {
-                 ardour_mute_states ^= 1 << button;
-                 lo_send(ardour, "/ardour/routes/mute", "ii", button + 1, (ardour_mute_states & (1 << button)) ? 1 : 0);
-               }
-            }
-            button == 0x1d && lo_send(ardour, "/ardour/transport_stop", "");
-            button == 0x1e && lo_send(ardour, "/ardour/transport_play", "");
-
-            if (value) {
-                button == 0x20 && lo_send(ardour, "/ardour/loop_toggle", "");
-                button == 0x22 && lo_send(ardour, "/ardour/rec_enable_toggle", "");
-                if (button == 0x13) {
-                    ardour_recen_states ^= 1 << 0;
-                    lo_send(ardour, "/ardour/routes/recenable", "ii", 1, (ardour_recen_states & (1 << 0)) ? 1 : 0);
-                }
-                if (button == 0x15) {
-                    ardour_recen_states ^= 1 << 1;
-                    lo_send(ardour, "/ardour/routes/recenable", "ii", 2, (ardour_recen_states & (1 << 1)) ? 1 : 0);
-                }
-                if (button == 0x17) {
-                    ardour_recen_states ^= 1 << 2;
-                    lo_send(ardour, "/ardour/routes/recenable", "ii", 3, (ardour_recen_states & (1 << 2)) ? 1 : 0);
-                }
-                if (button == 0x19) {
-                    ardour_recen_states ^= 1 << 3;
-                    lo_send(ardour, "/ardour/routes/recenable", "ii", 4, (ardour_recen_states & (1 << 3)) ? 1 : 0);
-                }
-                if (button == 0x1a) {
-                    ardour_recen_states ^= 1 << 4;
-                    lo_send(ardour, "/ardour/routes/recenable", "ii", 5, (ardour_recen_states & (1 << 4)) ? 1 : 0);
-                }
-                if (button == 0x1c) {
-                    ardour_recen_states ^= 1 << 5;
-                    lo_send(ardour, "/ardour/routes/recenable", "ii", 6, (ardour_recen_states & (1 << 5)) ? 1 : 0);
-                }
-                if (button == 0x1f) {
-                    ardour_recen_states ^= 1 << 6;
-                    lo_send(ardour, "/ardour/routes/recenable", "ii", 7, (ardour_recen_states & (1 << 6)) ? 1 : 0);
-                }
-                if (button == 0x21) {
-                    ardour_recen_states ^= 1 << 7;
-                    lo_send(ardour, "/ardour/routes/recenable", "ii", 8, (ardour_recen_states & (1 << 7)) ? 1 : 0);
-                }
-            }
-        }
+    void* controller_buf_out_jack = NULL;
+    if (controller) {
+        controller_buf_out_jack = jack_port_get_buffer(port.controller_out, nframes);
+        jack_midi_clear_buffer(controller_buf_out_jack);
     }
-}
 
-void pickup_from_queue(queue<midi_message_t>& queue,
-                       void *jack_midi_buffer,
-                       struct timespec& prev_cycle,
-                       struct timespec& cycle_period,
-                       jack_nframes_t nframes
-                       )
-{
-    jack_nframes_t last_framepos = 0;
-
-    while(!queue.empty()) {
-        midi_message_t msg = queue.front();
-        long nsec_since_start = diff(prev_cycle, msg.time).tv_nsec;
-        long framepos = (nsec_since_start * nframes) / cycle_period.tv_nsec;
-        if (framepos <= last_framepos) {
-            framepos = last_framepos + 1;
-        }
+    void* midi_buf_out_jack = jack_port_get_buffer(port.midi_out, nframes);
+    jack_midi_clear_buffer(midi_buf_out_jack);
 
-        if (framepos >= nframes) {
-            framepos = nframes - 1;
-        }
+    jack_time_t send_start = usecs_now();
 
-        if (state == LISTEN && &queue == &controller_queue) {
-            process_controller_out_message(msg);
+    // while the device is unplugged, what JACK sends it is dropped
+    if (device_acquire(dev)) {
+        if (controller) {
+            jack_to_usb(jack_port_get_buffer(port.controller_in, nframes), dev, true);
         }
+        jack_to_usb(jack_port_get_buffer(port.midi_in, nframes), dev, false);
+        device_release(dev);
+    }
 
-        uint8_t *buffer = jack_midi_event_reserve(jack_midi_buffer, framepos, msg.buffer.size());
-        if (buffer) {
-            memcpy(buffer, msg.buffer.data(), msg.buffer.size());
-        } else {
-            fprintf(stderr, "failed to allocate %d bytes midi buffer at framepos %ld (nframes = %d)",
-                    msg.buffer.size(), framepos, nframes);
-        }
+    jack_time_t send_usecs = usecs_now() - send_start;
 
-        queue.pop();
+    if (controller) {
+        jack_output_t controller_output = { controller_buf_out_jack };
+        pickup_from_queue(dev.controller_queue, controller_output, prev_cycle, cycle_period, nframes);
     }
-}
-
-void jack_to_usb(void *jack_midi_buffer, jack_port_t *jack_port, int endpoint, libusb_transfer_cb_fn callback)
-{
-    jack_midi_event_t in_event;
-    jack_nframes_t event_index = 0;
-    jack_nframes_t event_count = jack_midi_get_event_count(jack_midi_buffer);
 
-    for (event_index = 0; event_index < event_count; event_index++) {
-        jack_midi_event_get(&in_event, jack_midi_buffer, event_index);
+    jack_output_t midi_output = { midi_buf_out_jack };
+    pickup_from_queue(dev.midi_queue, midi_output, prev_cycle, cycle_period, nframes);
 
-        uint8_t* outbuf = (uint8_t*) malloc(in_event.size);
-        memcpy(outbuf, in_event.buffer, in_event.size);
-        struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-        libusb_fill_interrupt_transfer(transfer, devh, endpoint,
-                                       outbuf, in_event.size,
-                                       callback, outbuf, 0);
-        libusb_submit_transfer(transfer);
-    }
+    device_period_done<controller>(dev);
+    return send_usecs;
 }
 
 int process(jack_nframes_t nframes, void *arg)
 {
-    struct timespec prev_cycle = last_cycle;
-    clock_gettime(CLOCK_REALTIME, &last_cycle);
-    cycle_period = diff(prev_cycle, last_cycle);
-    if (cycle_period.tv_nsec <= 0) {
+    if (!update_cycle_times(nframes)) {
+        // nothing is picked up this period, but JACK reads the output
+        // ports anyway and they hold whatever was there before
+        for (int d = 0; d < device_count; d++) {
+            if (ports[d].controller_out) {
+                jack_midi_clear_buffer(jack_port_get_buffer(ports[d].controller_out, nframes));
+            }
+            jack_midi_clear_buffer(jack_port_get_buffer(ports[d].midi_out, nframes));
+        }
         return 0;
     }
 
-    int i;
+    jack_time_t send_usecs = 0;
 
-    void* controller_buf_out_jack;
-    if (ultranova) {
-        controller_buf_out_jack = jack_port_get_buffer(controller_out, nframes);
-        jack_midi_clear_buffer(controller_buf_out_jack);
-    }
+    for (int d = 0; d < device_count; d++) {
+        ports_t& port = ports[d];
+        jack_time_t device_start = usecs_now();
 
-    void* midi_buf_out_jack = jack_port_get_buffer(midi_out, nframes);
-    jack_midi_clear_buffer(midi_buf_out_jack);
+        send_usecs += port.process(devices[d], port, nframes);
 
-    if (ultranova) {
-        void* controller_buf_in_jack = jack_port_get_buffer(controller_in, nframes);
-        jack_to_usb(controller_buf_in_jack, controller_in, CONTROLLER_ENDPOINT_OUT, cb_controller_out);
+        jack_time_t device_usecs = usecs_now() - device_start;
+        port.process_cycles++;
+        port.process_usecs += device_usecs;
+        if (device_usecs > port.process_max_usecs) {
+            port.process_max_usecs = device_usecs;
+        }
     }
 
-    void* midi_buf_in_jack = jack_port_get_buffer(midi_in, nframes);
-    jack_to_usb(midi_buf_in_jack, midi_in, midi_endpoint_out, cb_midi_out);
-
-    if (ultranova) {
-        controller_mutex.lock();
-        pickup_from_queue(controller_queue, controller_buf_out_jack, prev_cycle, cycle_period, nframes);
-        controller_mutex.unlock();
+    jack_to_usb_cycles++;
+    jack_to_usb_usecs += send_usecs;
+    if (send_usecs > jack_to_usb_max_usecs) {
+        jack_to_usb_max_usecs = send_usecs;
+    }
+    if (jack_to_usb_scheduled) {
+        jack_to_usb_scheduled = false;
+        device_schedule_done();
     }
 
-    midi_mutex.lock();
-    pickup_from_queue(midi_queue, midi_buf_out_jack, prev_cycle, cycle_period, nframes);
-    midi_mutex.unlock();
-
+    driver_period_done();
     return 0;
 }
 
-
-bool buffer_equal(uint8_t *expected, uint8_t *actual, int length)
+// with --alsa: the USB and the controller thread pass what they queued on right away
+void alsa_drain(device_t& dev, midi_queue_t& queue)
 {
-    int i;
-
-    for (i = 0; i < length; i++) {
-        if (expected[i] != actual[i]) {
-            return false;
-        }
-    }
-
-    return true;
+    ports_t& port = ports[device_index(dev)];
+    drain_queue(queue, &queue == &dev.controller_queue ? port.alsa_controller_out : port.alsa_midi_out);
 }
 
-void process_incoming(struct libusb_transfer *transfer, struct timespec time, midi_message_t& msg, queue<midi_message_t>& queue)
+// runs on the ALSA thread: what other clients send to a keyboard
+void alsa_to_usb(snd_seq_event_t *event)
 {
-    int transfer_size = transfer->actual_length;
-    // byte position inside the incoming transfer buffer
-    int input_pos = 0;
-
-    while(input_pos < transfer_size) {
-        int event_size = 0;
-        if (msg.buffer.empty()) {
-            event_size = midi_event_size(transfer->buffer[input_pos]);
-        } else {
-            event_size = midi_event_size(msg.buffer[0]);
+    for (int d = 0; d < device_count; d++) {
+        device_t& dev = devices[d];
+        ports_t& port = ports[d];
+        bool controller = dev.profile->controller && event->dest.port == port.alsa_controller_in;
+        if (!controller && event->dest.port != port.alsa_midi_in) {
+            continue;
         }
 
-        if (event_size > 0 && event_size <= msg.buffer.size()) {
-                fprintf(stderr, "ERROR: already complete message contained, but not submitted, event_size: %d, message buffer size: %d\n", event_size, msg.buffer.size());
-                fprintf(stderr, "message buffer: \n");
-                for (int i=0; i < msg.buffer.size(); i++){
-                    fprintf(stderr, " 0x%02x,", msg.buffer[i]);
-                }
-                fputs("\n", stderr);
-                print_libusb_transfer(transfer);
+        uint8_t buf[16];
+        const uint8_t *bytes = buf;
+        long length;
+        if (event->type == SND_SEQ_EVENT_SYSEX) {
+            bytes  = (const uint8_t *)event->data.ext.ptr;
+            length = event->data.ext.len;
+        } else {
+            // anything but MIDI, like subscription notices, decodes to nothing
+            length = snd_midi_event_decode(alsa_decoder, buf, sizeof(buf), event);
+        }
+        if (length <= 0) {
+            return;
         }
 
-        if (event_size > 0) {
-            // how many bytes we still need to get in order
-            // for the current midi message to be complete
-            int remaining_size = event_size - msg.buffer.size();
-
-            if (remaining_size == 0) {
-                // complete event, submit the message
-                msg.time = time;
-                manipulate_automap(msg, queue);
-                queue.push(msg);
-                msg.buffer.clear();
-            } else  if (input_pos + remaining_size > transfer_size) {
-                // in this case we received some more bytes for the
-                // current message, but the message is not complete yet
-                // so then append the incoming bytes to the message
-                int i = 0;
-                for (i = input_pos; i < transfer_size; i++) {
-                    msg.buffer.push_back(transfer->buffer[i]);
-                }
-                input_pos = i;
-            } else if (0 <= remaining_size && input_pos + remaining_size <= transfer_size) {
-                // in this case we have received a complete event,
-                // so copy the data over to the message buffer
-                int i = 0;
-                for (i = input_pos; i < input_pos + remaining_size; i++) {
-                    msg.buffer.push_back(transfer->buffer[i]);
-                }
-                input_pos = i;
-                BOOST_ASSERT(event_size == msg.buffer.size());
-                msg.time = time;
-                manipulate_automap(msg, queue);
-                // and submit the message
-                queue.push(msg);
-                msg.buffer.clear();
-                // and continue to read the next message from the remaining
-                // input transfer bytes
-            } else {
-                fprintf(stderr, "ERROR, invalid remaining size %d (input_pos: %d, event_size: %d, message buffer size: %d)\n", remaining_size, input_pos, (int)event_size, msg.buffer.size());
-                fprintf(stderr, "message buffer: \n");
-                for (int i=0; i < msg.buffer.size(); i++){
-                    fprintf(stderr, " 0x%02x,", msg.buffer[i]);
-                }
-                fputs("\n", stderr);
-                print_libusb_transfer(transfer);
-                msg.buffer.clear();
-            }
-        } else {
-            // sysex
-            int i = 0;
-            for (i = input_pos; i < transfer_size; i++) {
-                if (transfer->buffer[i] != 0xf7) {
-                    msg.buffer.push_back(transfer->buffer[i]);
-                } else {
-                    msg.buffer.push_back(0xf7);
-                    msg.time = time;
-                    queue.push(msg);
-                    msg.buffer.clear();
-                    // account for last byte
-                    i++;
-                    // message complete, break out of for loop
-                    break;
-                }
-            }
-            input_pos = i;
+        if (device_acquire(dev)) {
+            device_send(dev, controller, bytes, length, usecs_now());
+            device_send_done(dev, controller);
+            device_release(dev);
         }
+        return;
     }
 }
 
-void cb_controller_out(struct libusb_transfer *transfer)
+#define ALSA_POLL_TIMEOUT_MSECS 100
+
+void *alsa_thread_main(void *arg)
 {
-    if (debug) {
-        fprintf(stderr, "cb_controller_out: ");
-        print_libusb_transfer(transfer);
+    struct pollfd fds[4];
+    int count = snd_seq_poll_descriptors(alsa.seq, fds, 4, POLLIN);
+
+    while (!quit) {
+        if (poll(fds, count, ALSA_POLL_TIMEOUT_MSECS) <= 0) {
+            continue;
+        }
+
+        snd_seq_event_t *event;
+        while (snd_seq_event_input(alsa.seq, &event) >= 0) {
+            alsa_to_usb(event);
+        }
     }
-    libusb_free_transfer(transfer);
+
+    return NULL;
 }
 
-void cb_midi_out(struct libusb_transfer *transfer)
+// a single device keeps the plain port names
+const char *port_name(device_t& dev, const char *port)
 {
-    if (debug) {
-        fprintf(stderr, "cb_midi_out: ");
-        print_libusb_transfer(transfer);
+    static char name[64];
+    if (device_count > 1) {
+        snprintf(name, sizeof(name), "%s_%s", dev.name, port);
+    } else {
+        snprintf(name, sizeof(name), "%s", port);
     }
-    libusb_free_transfer(transfer);
+    return name;
 }
 
-void cb_controller_in(struct libusb_transfer *transfer)
+bool device_register_ports(device_t& dev, ports_t& port)
 {
-    clock_gettime(CLOCK_REALTIME, &controller_in_t);
-
-    if (debug) {
-        fprintf(stderr, "cb_controller_in: ");
-        print_libusb_transfer(transfer);
-    }
-
-    static midi_message_t msg;
-
-    if (transfer->actual_length == sizeof(automap_button_press_in) &&
-       buffer_equal(automap_ok, transfer->buffer, sizeof(automap_button_press_in))) {
-        state = AUTOMAP_PRESSED;
-        fprintf(stderr, "AUTOMAP PRESSED\n");
+    if (dev.profile->controller) {
+        port.controller_out = jack_port_register (client, port_name(dev, "controller_out"), JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+        port.controller_in  = jack_port_register (client, port_name(dev, "controller_in"),  JACK_DEFAULT_MIDI_TYPE, JackPortIsInput,  0);
+        port.process = process_device<true>;
+    } else {
+        port.process = process_device<false>;
     }
 
-    switch(state) {
-    case STARTUP:
-        if (transfer->actual_length == sizeof(automap_ok) &&
-           buffer_equal(automap_ok, transfer->buffer, sizeof(automap_ok))) {
-            state = LISTEN;
-        } else if (transfer->actual_length == sizeof(automap_off) &&
-                  buffer_equal(automap_off, transfer->buffer, sizeof(automap_off))) {
-            state = WAIT_FOR_AUTOMAP;
-        } else {
-            fprintf(stderr, "state STARTUP, got unexpected reply\n");
-            fflush(stderr);
-        }
-        break;
-
-    case WAIT_FOR_AUTOMAP:
-        if (transfer->actual_length == sizeof(automap_ok) &&
-           buffer_equal(automap_ok, transfer->buffer, sizeof(automap_ok))) {
-            state = LISTEN;
-
-            struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-            libusb_fill_interrupt_transfer(transfer, devh, CONTROLLER_ENDPOINT_OUT,
-                                           automap_ok, sizeof(automap_ok),
-                                           cb_controller_out, NULL, 0);
-            libusb_submit_transfer(transfer);
-
-            transfer = libusb_alloc_transfer(0);
-            libusb_fill_interrupt_transfer(transfer, devh, CONTROLLER_ENDPOINT_OUT,
-                                           ultranova4linux_greeting,
-                                           sizeof(ultranova4linux_greeting),
-                                           cb_controller_out, NULL, 0);
-            libusb_submit_transfer(transfer);
-        }
-        break;
-
-    case AUTOMAP_PRESSED:
-        state = LISTEN;
-        break;
-
-    case LISTEN:
-        if (transfer->actual_length == sizeof(automap_off) &&
-           buffer_equal(automap_off, transfer->buffer, sizeof(automap_off))) {
-            state = WAIT_FOR_AUTOMAP;
-        } else {
-            controller_mutex.lock();
-            process_incoming(transfer, controller_in_t, msg, controller_queue);
-            if (is(msg, button_octave_minus)) automap_octave -= 1;
-            if (is(msg, button_octave_plus))  automap_octave += 1;
-            automap_octave = clamp_to(automap_octave, -4, +4);
-            if (automap_octave  > 0)   set_automap_led(led_octave_plus, 1);
-            if (automap_octave == 0) { set_automap_led(led_octave_plus, 0); set_automap_led(led_octave_minus, 0); }
-            if (automap_octave  < 0)   set_automap_led(led_octave_minus, 1);
-            controller_mutex.unlock();
-        }
-        break;
-
-    default:
-        break;
-    }
+    port.midi_out = jack_port_register (client, port_name(dev, "midi_out"), JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+    port.midi_in  = jack_port_register (client, port_name(dev, "midi_in"),  JACK_DEFAULT_MIDI_TYPE, JackPortIsInput,  0);
 
-    if (msg.buffer.size()) {
-        fprintf(stderr, "pending controller message size: %d\n\n", msg.buffer.size());
+    if (!port.midi_out || !port.midi_in || (dev.profile->controller && (!port.controller_out || !port.controller_in))) {
+        fprintf(stderr, "%s: cannot register JACK ports\n", dev.name);
+        return false;
     }
 
-    libusb_submit_transfer(controller_transfer_in);
+    return true;
 }
 
-volatile bool aftertouch_seen = false;
-
-void cb_midi_in(struct libusb_transfer *transfer)
+bool device_create_alsa_ports(device_t& dev, ports_t& port)
 {
-    clock_gettime(CLOCK_REALTIME, &midi_in_t);
-
-    if (debug) {
-        fprintf(stderr, "cb_midi_in: ");
-        print_libusb_transfer(transfer);
+    if (dev.profile->controller) {
+        if (!port.alsa_controller_out.init(alsa, port_name(dev, "controller_out"))) {
+            return false;
+        }
+        port.alsa_controller_in = alsa_seq_port(alsa, port_name(dev, "controller_in"), false);
+        if (port.alsa_controller_in < 0) {
+            return false;
+        }
+    } else {
+        port.alsa_controller_in = -1;
     }
 
-    static midi_message_t msg;
-
-    midi_mutex.lock();
-    process_incoming(transfer, midi_in_t, msg, midi_queue);
-    midi_mutex.unlock();
-
-    if (msg.buffer.size() && debug) {
-        fprintf(stderr, "pending midi message size: %d\n\n", msg.buffer.size());
+    if (!port.alsa_midi_out.init(alsa, port_name(dev, "midi_out"))) {
+        return false;
     }
-
-    libusb_submit_transfer(midi_transfer_in);
+    port.alsa_midi_in = alsa_seq_port(alsa, port_name(dev, "midi_in"), false);
+    return port.alsa_midi_in >= 0;
 }
 
 int main(int argc, char *argv[])
 {
-    bool control_ardour = false;
-
+    driver_config_init(config);
+    config.on_failure = driver_failure;
+    main_thread = pthread_self();
     for (int i = 0; i < argc; i++){
         if (strcmp(argv[i], "--debug") == 0) {
-            debug = true;
+            config.debug = true;
         } else if (strcmp(argv[i], "--ardour-osc") == 0) {
-            control_ardour = true;
+            config.control_ardour = true;
+        } else if (strcmp(argv[i], "--batch-out") == 0) {
+            config.batch_out = true;
+        } else if (strcmp(argv[i], "--schedule-out") == 0) {
+            config.schedule_out = true;
+        } else if (strcmp(argv[i], "--out-priority") == 0 && i + 1 < argc) {
+            config.out_priority = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--alsa") == 0) {
+            use_alsa = true;
+        } else if (strcmp(argv[i], "--alsa-priority") == 0 && i + 1 < argc) {
+            alsa_thread.priority = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--octave-panic") == 0) {
+            config.octave_panic = true;
+        } else if (strcmp(argv[i], "--in-transfers") == 0 && i + 1 < argc) {
+            config.in_transfer_count = clamp_to(atoi(argv[++i]), 1, MAX_IN_TRANSFERS);
+        } else if (strcmp(argv[i], "--usb-priority") == 0 && i + 1 < argc) {
+            config.usb_priority = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--usb-cpu") == 0 && i + 1 < argc) {
+            config.usb_cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--controller-priority") == 0 && i + 1 < argc) {
+            config.controller_priority = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--controller-cpu") == 0 && i + 1 < argc) {
+            config.controller_cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+            config.mapping_file = argv[++i];
+        } else if (strcmp(argv[i], "--osc-rate") == 0 && i + 1 < argc) {
+            // maximum rate of encoder updates per second, 0 for once per JACK cycle
+            int rate = atoi(argv[++i]);
+            config.encoder_osc_interval = rate > 0 ? 1000000 / rate : 0;
+        } else if (strcmp(argv[i], "--sysex-buffer") == 0 && i + 1 < argc) {
+            // KB, for the largest sysex dump expected
+            config.sysex_buffer_size = clamp_to(atoi(argv[++i]), 1, 64 * 1024) * 1024;
+        } else if (strcmp(argv[i], "--sysex-split") == 0) {
+            config.sysex_split = true;
+        } else if (strcmp(argv[i], "--fixed-latency") == 0) {
+            config.fixed_latency = true;
+        } else if ((strcmp(argv[i], "--thin-aftertouch") == 0 || strcmp(argv[i], "--thin-cc") == 0 ||
+                    strcmp(argv[i], "--thin-pitchbend") == 0) && i + 1 < argc) {
+            // MSECS[:DELTA], values closer than MSECS and DELTA to the last one are merged
+            int msecs = 0, delta = 0;
+            sscanf(argv[i + 1], "%d:%d", &msecs, &delta);
+            thin_rule_t rule = { (uint64_t)clamp_to(msecs, 0, 1000) * 1000, clamp_to(delta, 0, 16383) };
+            if (strcmp(argv[i], "--thin-aftertouch") == 0) {
+                config.thin_rules[THIN_AFTERTOUCH]      = rule;
+                config.thin_rules[THIN_POLY_AFTERTOUCH] = rule;
+            } else if (strcmp(argv[i], "--thin-cc") == 0) {
+                config.thin_rules[THIN_CONTROL_CHANGE]  = rule;
+            } else {
+                config.thin_rules[THIN_PITCH_BEND]      = rule;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--recorder") == 0 && i + 1 < argc) {
+            config.recorder_file = argv[++i];
+        } else if (strcmp(argv[i], "--recorder-size") == 0 && i + 1 < argc) {
+            // MB, 0 turns the flight recorder off
+            config.recorder_size = (size_t)clamp_to(atoi(argv[++i]), 0, 1024) * 1024 * 1024;
         }
     }
 
-    struct sigaction sigact;
-
-    int r = 1;  // result
-    int i;
-
-    //init libUSB
-    r = libusb_init(NULL);
-    if (r < 0) {
-        fprintf(stderr, "Failed to initialise libusb\n");
-        return 1;
+    if (!use_alsa) {
+        config.clock = jack_get_time;
+    } else {
+        config.drain = alsa_drain;
+        if (config.schedule_out) {
+            // sequencer events come without a time to keep
+            fprintf(stderr, "--schedule-out has no effect with --alsa\n");
+            config.schedule_out = false;
+        }
     }
 
-    //open the device
-    devh = libusb_open_device_with_vid_pid(ctx, USB_VENDOR_ID, ULTRANOVA_PRODUCT_ID);
+    // finds and sets up the keyboards, everything but their ports
+    bool success = driver_open(config);
+
+    const char *client_name = device_count > 1 ? "novation" : devices[0].name;
 
-    if (!devh) {
-        devh = libusb_open_device_with_vid_pid(ctx, USB_VENDOR_ID, MININOVA_PRODUCT_ID);
-        if (!devh) {
-            perror("neither Novation Ultranova nor Novation Mininova found");
-            return 1;
+    // or ALSA sequencer ports, of one client as well
+    if (success && use_alsa) {
+        fprintf(stderr, "initializing ALSA sequencer\n");
+        if (!alsa_seq_open(alsa, client_name) || snd_midi_event_new(ALSA_SYSEX_CHUNK, &alsa_decoder) < 0) {
+            success = false;
+        } else {
+            snd_midi_event_no_status(alsa_decoder, 1);
         }
 
-        // we have a mininova
-        ultranova = false;
-        midi_endpoint_in  = MININOVA_MIDI_ENDPOINT_IN;
-        midi_endpoint_out = MININOVA_MIDI_ENDPOINT_OUT;
-    }
-
-    //claim the interface
-    bool success = ultranova ?
-       (libusb_claim_interface(devh, 0) >= 0 &&
-        libusb_claim_interface(devh, 1) >= 0 &&
-        libusb_claim_interface(devh, 3) >= 0)
-       :
-       (libusb_claim_interface(devh, 0) >= 0);
-
-    if (!success) {
-        fprintf(stderr, "usb_claim_interface error\n");
-        exitflag = OUT;
-        do_exit = true;
-    } else  {
-        fprintf(stderr, "Claimed interface\n");
-
-        // init OSC
-        if (ultranova && control_ardour) {
-            ardour = lo_address_new_from_url("osc.udp://localhost:3819/");
+        for (int d = 0; success && d < device_count; d++) {
+            success = device_create_alsa_ports(devices[d], ports[d]);
         }
+    }
 
-        // init jack
+    // init jack, one client for all devices
+    if (success && !use_alsa) {
         fprintf(stderr, "initializing jack\n");
-        if ((client = jack_client_open (ultranova ? "ultranova" : "mininova", JackNullOption, NULL)) == 0) {
+        if ((client = jack_client_open (client_name, JackNullOption, NULL)) == 0) {
             fprintf (stderr, "jack server not running?\n");
-            do_exit = true;
+            success = false;
         }
+    }
 
+    if (success && !use_alsa) {
         jack_set_process_callback (client, process, 0);
+        jack_set_buffer_size_callback (client, buffer_size_changed, 0);
 
-        if (ultranova) {
-            controller_out = jack_port_register (client, "controller_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
-            controller_in  = jack_port_register (client, "controller_in",  JACK_DEFAULT_MIDI_TYPE, JackPortIsInput,  0);
+        for (int d = 0; success && d < device_count; d++) {
+            success = device_register_ports(devices[d], ports[d]);
         }
 
-        midi_out    = jack_port_register (client, "midi_out",    JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
-        midi_in     = jack_port_register (client, "midi_in",     JACK_DEFAULT_MIDI_TYPE, JackPortIsInput,  0);
-
-        nframes = jack_get_buffer_size(client);
-        if (jack_activate(client)) {
+        nframes     = jack_get_buffer_size(client);
+        sample_rate = jack_get_sample_rate(client);
+        if (success && jack_activate(client)) {
             fprintf (stderr, "cannot activate client");
-            do_exit = true;
-        }
-
-        // allocate transfers
-        if (ultranova) {
-            controller_transfer_in = libusb_alloc_transfer(0);
-        }
-        midi_transfer_in = libusb_alloc_transfer(0);
-
-        if (ultranova) {
-            libusb_fill_interrupt_transfer(controller_transfer_in, devh, CONTROLLER_ENDPOINT_IN,
-                                           in_buffer_control, CONTROLLER_MAXLENGTH,
-                                           cb_controller_in, NULL, 0);
-        }
-        libusb_fill_interrupt_transfer(midi_transfer_in, devh, midi_endpoint_in,
-                                       in_buffer_midi, LEN_IN_BUFFER,
-                                       cb_midi_in, NULL, 0);
-
-        //submit the transfer, all following transfers are initiated from the CB
-        if (ultranova) {
-            libusb_submit_transfer(controller_transfer_in);
-        }
-        libusb_submit_transfer(midi_transfer_in);
-
-        if (ultranova) {
-            struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-            libusb_fill_interrupt_transfer(transfer, devh, CONTROLLER_ENDPOINT_OUT,
-                                           automap_ok, sizeof(automap_ok),
-                                           cb_controller_out, NULL, 0);
-            libusb_submit_transfer(transfer);
+            success = false;
         }
+    }
 
+    bool alsa_running = false;
+    if (success) {
         // Define signal handler to catch system generated signals
         // (If user hits CTRL+C, this will deal with it.)
-        sigact.sa_handler = sighandler;  // sighandler is defined below. It just sets do_exit.
+        struct sigaction sigact;
+        sigact.sa_handler = sighandler;  // sighandler is defined below. It just sets quit.
         sigemptyset(&sigact.sa_mask);
         sigact.sa_flags = 0;
         sigaction(SIGINT, &sigact, NULL);
         sigaction(SIGTERM, &sigact, NULL);
         sigaction(SIGQUIT, &sigact, NULL);
+        sigact.sa_handler = sighup_handler;
+        sigaction(SIGHUP, &sigact, NULL);
+        sigact.sa_handler = sigusr1_handler;
+        sigaction(SIGUSR1, &sigact, NULL);
 
         printf("Entering loop to process callbacks...\n");
-    }
 
-   /* The implementation of the following while loop makes a huge difference.
-    * Since libUSB asynchronous mode doesn't create a background thread,
-    * libUSB can't create a callback out of nowhere. This loop calls the event handler.
-    * In real applications you might want to create a background thread or call the event
-    * handler from your main event hanlder.
-    * For a proper description see:
-    * http://libusbx.sourceforge.net/api-1.0/group__asyncio.html#asyncevent
-    * http://libusbx.sourceforge.net/api-1.0/group__poll.html
-    * http://libusbx.sourceforge.net/api-1.0/mtasync.html
-    */
-    if (1) {
-        // This implementation uses a blocking call
-        while (!do_exit) {
-            r = libusb_handle_events_completed(ctx, NULL);
-            if (r < 0){   // negative values are errors
-                exitflag = OUT_DEINIT;
-                break;
+       /* The USB thread of the driver calls the libusb event handler, so all
+        * transfer callbacks of all devices run on it. Signals are blocked there,
+        * this thread waits for them: SIGHUP reloads the mapping, the others set
+        * quit, and driver_stop() ends the threads of the driver.
+        */
+        success = driver_start();
+        if (success &&
+            (!use_alsa || (alsa_running = rt_thread_start(alsa_thread, alsa_thread_main, NULL)))) {
+            sigset_t signals, old_signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGINT);
+            sigaddset(&signals, SIGTERM);
+            sigaddset(&signals, SIGQUIT);
+            sigaddset(&signals, SIGHUP);
+            sigaddset(&signals, SIGUSR1);
+            pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+            while (!quit) {
+                sigsuspend(&old_signals);
+                if (reload_mapping) {
+                    reload_mapping = false;
+                    reload_mapping_table();
+                }
+                if (print_latency) {
+                    print_latency = false;
+                    print_latency_stats();
+                }
             }
+
+            pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
         }
-    } else {
-        // This implementation uses a blocking call and aquires a lock to the event handler
-        struct timeval timeout;
-        timeout.tv_sec  = 0;       // seconds
-        timeout.tv_usec = 100000;  // ( .1 sec)
-        libusb_lock_events(ctx);
-        while (!do_exit) {
-            r = libusb_handle_events_locked(ctx, &timeout);
-            if (r < 0){   // negative values are errors
-                exitflag = OUT_DEINIT;
-                break;
-            }
+
+        driver_stop();
+        if (alsa_running) {
+            pthread_join(alsa_thread.thread, NULL);
         }
-        libusb_unlock_events(ctx);
     }
 
-    switch(exitflag) {
-    case OUT_DEINIT:
-        printf("at OUT_DEINIT\n");
+    if (client) {
         jack_client_close(client);
+    }
+    if (alsa_decoder) {
+        snd_midi_event_free(alsa_decoder);
+    }
 
-    case OUT_RELEASE:
-        libusb_release_interface(devh, 0);
-        if (ultranova) {
-            libusb_release_interface(devh, 1);
-            libusb_release_interface(devh, 3);
+    driver_print_stats();
+    for (int d = 0; d < device_count; d++) {
+        if (ports[d].process_cycles) {
+            fprintf(stderr, "%s JACK thread: %.2f usecs per cycle, %lu usecs max\n", devices[d].name,
+                    (double)ports[d].process_usecs / ports[d].process_cycles, (unsigned long)ports[d].process_max_usecs);
+        }
+    }
+    if (use_alsa) {
+        rt_thread_print_stats(alsa_thread);
+        if (alsa.dropped) {
+            fprintf(stderr, "ALSA sequencer: %lu events dropped\n", (unsigned long)alsa.dropped);
         }
+    }
+    if (jack_to_usb_cycles) {
+        fprintf(stderr, "JACK to USB (%s): %.2f usecs per cycle, %lu usecs max\n",
+                config.schedule_out ? "scheduled" : config.batch_out ? "batched" : "unbatched",
+                (double)jack_to_usb_usecs / jack_to_usb_cycles, (unsigned long)jack_to_usb_max_usecs);
+    }
 
-    case OUT:
-        libusb_close(devh);
-        libusb_exit(NULL);
+    // driver_close() forgets the devices
+    for (int d = 0; d < device_count; d++) {
+        ports[d].alsa_midi_out.free();
+        ports[d].alsa_controller_out.free();
     }
-    return 0;
+    alsa_seq_close(alsa);
+    bool failed = driver_failed();
+    driver_close();
+
+    return success && !failed ? 0 : 1;
+}
+
+// on the USB thread of the driver: wake up the main thread, which ends the program
+void driver_failure()
+{
+    pthread_kill(main_thread, SIGTERM);
 }
 
 
@@ -795,50 +599,15 @@ int main(int argc, char *argv[])
 void sighandler(int signum)
 {
     printf("sighandler\n");
-    do_exit = true;
+    quit = true;
 }
 
-
-// debugging function to display libusb_transfer
-inline void print_libusb_transfer(struct libusb_transfer *p_t)
-{   
-    int i;
-    if (NULL == p_t) {
-        printf("No libusb_transfer...\n");
-    }
-    else {
-        printf("state: %s\n", state_names[state]);
-
-        printf("libusb_transfer structure:\n");
-        printf("status  = %x \n", p_t->status);
-        printf("flags   = %x \n", p_t->flags);
-        printf("endpoint= %x \n", p_t->endpoint);
-        printf("type    = %x \n", p_t->type);
-        printf("timeout = %d \n", p_t->timeout);
-        // length, and buffer are commands sent to the device
-        printf("length        = %d \n", p_t->length);
-        printf("actual_length = %d \n", p_t->actual_length);
-
-        for (i=0; i < p_t->actual_length; i++){
-            printf(" 0x%02x,", p_t->buffer[i]);
-        }
-        puts("\n\n");
-    }
-
-    fflush(stdout);
-    return;
+void sighup_handler(int signum)
+{
+    reload_mapping = true;
 }
 
-inline struct timespec diff(struct timespec start, struct timespec end)
+void sigusr1_handler(int signum)
 {
-	struct timespec temp;
-	if ((end.tv_nsec - start.tv_nsec) < 0) {
-		temp.tv_sec  = end.tv_sec - start.tv_sec - 1;
-		temp.tv_nsec = 1000000000 + end.tv_nsec - start.tv_nsec;
-	} else {
-		temp.tv_sec  = end.tv_sec  - start.tv_sec;
-		temp.tv_nsec = end.tv_nsec - start.tv_nsec;
-	}
-	return temp;
+    print_latency = true;
 }
-
@@ -0,0 +1,302 @@
+/*
+ * compiles mapping files into mapping tables
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mapping.h"
+
+// what ultranova4linux always did for Ardour
+static const char *default_mapping =
+    "# encoders send relative values, turn them into absolute positions\n"
+    "0xb0 0x10-0x19 encoder\n"
+    "# the first eight encoders control the gain of the first eight routes,\n"
+    "# the ninth the gain of the master bus\n"
+    "0xb0 0x10 osc /ardour/routes/gainabs 1   $gain\n"
+    "0xb0 0x11 osc /ardour/routes/gainabs 2   $gain\n"
+    "0xb0 0x12 osc /ardour/routes/gainabs 3   $gain\n"
+    "0xb0 0x13 osc /ardour/routes/gainabs 4   $gain\n"
+    "0xb0 0x14 osc /ardour/routes/gainabs 5   $gain\n"
+    "0xb0 0x15 osc /ardour/routes/gainabs 6   $gain\n"
+    "0xb0 0x16 osc /ardour/routes/gainabs 7   $gain\n"
+    "0xb0 0x17 osc /ardour/routes/gainabs 8   $gain\n"
+    "0xb0 0x18 osc /ardour/routes/gainabs 318 $gain\n"
+    "\n"
+    "0xb2 * button\n"
+    "# first row of buttons mutes\n"
+    "0xb2 0x00 toggle /ardour/routes/mute 1 $state\n"
+    "0xb2 0x01 toggle /ardour/routes/mute 2 $state\n"
+    "0xb2 0x02 toggle /ardour/routes/mute 3 $state\n"
+    "0xb2 0x03 toggle /ardour/routes/mute 4 $state\n"
+    "0xb2 0x04 toggle /ardour/routes/mute 5 $state\n"
+    "0xb2 0x05 toggle /ardour/routes/mute 6 $state\n"
+    "0xb2 0x06 toggle /ardour/routes/mute 7 $state\n"
+    "0xb2 0x07 toggle /ardour/routes/mute 8 $state\n"
+    "# transport\n"
+    "0xb2 0x1d osc /ardour/transport_stop\n"
+    "0xb2 0x1e osc /ardour/transport_play\n"
+    "0xb2 0x20 osc press /ardour/loop_toggle\n"
+    "0xb2 0x22 osc press /ardour/rec_enable_toggle\n"
+    "# record enable\n"
+    "0xb2 0x13 toggle /ardour/routes/recenable 1 $state\n"
+    "0xb2 0x15 toggle /ardour/routes/recenable 2 $state\n"
+    "0xb2 0x17 toggle /ardour/routes/recenable 3 $state\n"
+    "0xb2 0x19 toggle /ardour/routes/recenable 4 $state\n"
+    "0xb2 0x1a toggle /ardour/routes/recenable 5 $state\n"
+    "0xb2 0x1c toggle /ardour/routes/recenable 6 $state\n"
+    "0xb2 0x1f toggle /ardour/routes/recenable 7 $state\n"
+    "0xb2 0x21 toggle /ardour/routes/recenable 8 $state\n";
+
+#define SEPARATORS " \t\r\n"
+
+static bool parse_number(const char *token, int min, int max, int *result)
+{
+    if (!token) {
+        return false;
+    }
+
+    char *end;
+    long value = strtol(token, &end, 0);
+    if (end == token || *end || value < min || value > max) {
+        return false;
+    }
+
+    *result = value;
+    return true;
+}
+
+static bool parse_arg(const char *token, mapping_action_t& action, int i)
+{
+    action.sources[i] = ARG_CONST;
+
+    if (strcmp(token, "$value") == 0) {
+        action.types[i]   = 'i';
+        action.sources[i] = ARG_VALUE;
+    } else if (strcmp(token, "$gain") == 0) {
+        action.types[i]   = 'f';
+        action.sources[i] = ARG_GAIN;
+    } else if (strcmp(token, "$state") == 0) {
+        action.types[i]   = 'i';
+        action.sources[i] = ARG_STATE;
+    } else if (strchr(token, '.')) {
+        char *end;
+        action.types[i]  = 'f';
+        action.args[i].f = strtod(token, &end);
+        if (*end) {
+            return false;
+        }
+    } else {
+        int value;
+        if (!parse_number(token, -0x7fffffff, 0x7fffffff, &value)) {
+            return false;
+        }
+        action.types[i]  = 'i';
+        action.args[i].i = value;
+    }
+
+    return true;
+}
+
+// OSC path and arguments of osc and toggle
+static const char *parse_osc(char *token, char **save, mapping_action_t& action)
+{
+    if (token[0] != '/' || strlen(token) >= OSC_MAX_PATH) {
+        return "invalid OSC path";
+    }
+    strcpy(action.path, token);
+
+    int i = 0;
+    while ((token = strtok_r(NULL, SEPARATORS, save))) {
+        if (i == OSC_MAX_ARGS) {
+            return "too many OSC arguments";
+        }
+        if (!parse_arg(token, action, i++)) {
+            return "invalid OSC argument";
+        }
+    }
+
+    return NULL;
+}
+
+// tails of the action chains, while the table is being compiled
+static uint16_t last[128][128];
+
+static const char *parse_line(mapping_table_t *table, char *line)
+{
+    char *comment = strchr(line, '#');
+    if (comment) {
+        *comment = 0;
+    }
+
+    char *save;
+    char *token = strtok_r(line, SEPARATORS, &save);
+    if (!token) {
+        return NULL;
+    }
+
+    int status;
+    if (!parse_number(token, 0x80, 0xff, &status)) {
+        return "invalid status byte";
+    }
+
+    int from, to;
+    token = strtok_r(NULL, SEPARATORS, &save);
+    if (token && strcmp(token, "*") == 0) {
+        from = 0;
+        to   = 127;
+    } else {
+        char *dash = token ? strchr(token, '-') : NULL;
+        if (dash) {
+            *dash = 0;
+            if (!parse_number(dash + 1, 0, 127, &to)) {
+                return "invalid data byte range";
+            }
+        }
+        if (!parse_number(token, 0, 127, &from)) {
+            return "invalid data byte";
+        }
+        if (!dash) {
+            to = from;
+        }
+    }
+
+    mapping_action_t action;
+    memset(&action, 0, sizeof(action));
+
+    token = strtok_r(NULL, SEPARATORS, &save);
+    if (!token) {
+        return "missing action";
+    }
+    char *name = token;
+
+    token = strtok_r(NULL, SEPARATORS, &save);
+    if (token && strcmp(token, "press") == 0) {
+        action.press = true;
+        token = strtok_r(NULL, SEPARATORS, &save);
+    }
+
+    const char *error = NULL;
+    if (strcmp(name, "encoder") == 0) {
+        action.type = ACTION_ENCODER;
+    } else if (strcmp(name, "button") == 0) {
+        action.type = ACTION_BUTTON;
+    } else if (strcmp(name, "osc") == 0) {
+        action.type = ACTION_OSC;
+        if (!token) {
+            return "missing OSC path";
+        }
+        error = parse_osc(token, &save, action);
+        token = NULL;
+    } else if (strcmp(name, "toggle") == 0) {
+        action.type  = ACTION_TOGGLE;
+        action.press = true;
+        if (token) {
+            error = parse_osc(token, &save, action);
+            token = NULL;
+        }
+    } else if (strcmp(name, "remap") == 0) {
+        int remap_status, remap_data1;
+        action.type = ACTION_REMAP;
+        if (!parse_number(token, 0x80, 0xff, &remap_status) ||
+            !parse_number(strtok_r(NULL, SEPARATORS, &save), 0, 127, &remap_data1)) {
+            return "remap needs a status and a data byte";
+        }
+        action.status = remap_status;
+        action.data1  = remap_data1;
+        token = strtok_r(NULL, SEPARATORS, &save);
+    } else if (strcmp(name, "led") == 0) {
+        int led;
+        action.type = ACTION_LED;
+        if (!parse_number(token, 0, 127, &led)) {
+            return "invalid LED";
+        }
+        action.led = led;
+        token = strtok_r(NULL, SEPARATORS, &save);
+        if (!token || !parse_arg(token, action, 0)) {
+            return "invalid LED value";
+        }
+        token = strtok_r(NULL, SEPARATORS, &save);
+    } else {
+        return "unknown action";
+    }
+
+    if (error) {
+        return error;
+    }
+    if (token) {
+        return "too many arguments";
+    }
+
+    for (int data1 = from; data1 <= to; data1++) {
+        if (table->count == MAPPING_MAX_ACTIONS) {
+            return "too many actions";
+        }
+
+        table->actions[table->count] = action;
+        uint16_t index = ++table->count;
+
+        uint16_t& tail = last[status & 0x7f][data1];
+        if (tail) {
+            table->actions[tail - 1].next = index;
+        } else {
+            table->first[status & 0x7f][data1] = index;
+        }
+        tail = index;
+    }
+
+    return NULL;
+}
+
+mapping_table_t *mapping_load(const char *filename)
+{
+    mapping_table_t *table = (mapping_table_t *)calloc(1, sizeof(mapping_table_t));
+    if (!table) {
+        return NULL;
+    }
+    memset(last, 0, sizeof(last));
+
+    FILE *file;
+    if (filename) {
+        file = fopen(filename, "r");
+        if (!file) {
+            perror(filename);
+            free(table);
+            return NULL;
+        }
+    } else {
+        file = fmemopen((void *)default_mapping, strlen(default_mapping), "r");
+    }
+
+    char line[256];
+    int line_number = 0;
+    const char *error = NULL;
+    while (!error && fgets(line, sizeof(line), file)) {
+        line_number++;
+        size_t length = strlen(line);
+        if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+            // unless it is the last line, the rest would be taken for a line of its own
+            int next = fgetc(file);
+            if (next != EOF) {
+                error = "line too long";
+                break;
+            }
+        }
+        error = parse_line(table, line);
+    }
+    fclose(file);
+
+    if (error) {
+        fprintf(stderr, "%s:%d: %s\n", filename ? filename : "built-in mapping", line_number, error);
+        free(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+void mapping_free(mapping_table_t *table)
+{
+    free(table);
+}
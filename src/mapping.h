@@ -0,0 +1,94 @@
+/*
+ * controller to action mapping
+ *
+ * A mapping file is compiled into a flat table, which for every status
+ * and data byte of an incoming three byte message holds the chain of
+ * actions to run, so dispatching a message is a single lookup.
+ *
+ * Each line of a mapping file maps one message to one action:
+ *
+ *   <status> <data1> <action> [press] <arguments>
+ *
+ * data1 is a number, a range like 0x10-0x19 or * for all of them.
+ * Several lines for the same message run in the order of the file.
+ * With press, the action only runs if data2 is not 0. Actions:
+ *
+ *   encoder                  relative encoder, data2 becomes its absolute position
+ *   button                   data2 becomes 0 or 127
+ *   osc <path> <args>        send an OSC message
+ *   toggle [<path> <args>]   flip the state of the message, only on press
+ *   remap <status> <data1>   rewrite the message
+ *   led <led> <value>        set an Automap LED
+ *
+ * Arguments are integers, floats (containing a dot), $value (data2),
+ * $gain (data2 scaled to 0.0 .. 2.0) or $state (toggle state, 0 or 1).
+ * Everything after # is a comment.
+ */
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <stdint.h>
+#include "osc_sender.h"
+
+#define MAPPING_MAX_ACTIONS 1024
+
+typedef enum {
+    ACTION_ENCODER,
+    ACTION_BUTTON,
+    ACTION_OSC,
+    ACTION_TOGGLE,
+    ACTION_REMAP,
+    ACTION_LED,
+} action_type_t;
+
+// where an argument gets its value from
+typedef enum {
+    ARG_CONST,
+    ARG_VALUE,
+    ARG_GAIN,
+    ARG_STATE,
+} arg_source_t;
+
+typedef struct {
+    uint8_t type;
+    bool press;
+    // index + 1 of the next action for the same message, 0 ends the chain
+    uint16_t next;
+
+    // remap
+    uint8_t status;
+    uint8_t data1;
+
+    // led, its value is args[0]
+    uint8_t led;
+
+    // osc and toggle, an empty path sends nothing
+    char path[OSC_MAX_PATH];
+    char types[OSC_MAX_ARGS + 1];
+    uint8_t sources[OSC_MAX_ARGS];
+    osc_arg_t args[OSC_MAX_ARGS];
+} mapping_action_t;
+
+typedef struct {
+    // indexed by [status - 0x80][data1], index + 1 of the first action, 0 if unmapped
+    uint16_t first[128][128];
+    mapping_action_t actions[MAPPING_MAX_ACTIONS];
+    int count;
+} mapping_table_t;
+
+// filename NULL compiles the built-in Ardour mapping, returns NULL on errors
+mapping_table_t *mapping_load(const char *filename);
+void mapping_free(mapping_table_t *table);
+
+inline mapping_action_t *mapping_first(mapping_table_t *table, uint8_t status, uint8_t data1)
+{
+    uint16_t index = table->first[(status & 0x7f)][data1 & 0x7f];
+    return index ? &table->actions[index - 1] : NULL;
+}
+
+inline mapping_action_t *mapping_next(mapping_table_t *table, mapping_action_t *action)
+{
+    return action->next ? &table->actions[action->next - 1] : NULL;
+}
+
+#endif
@@ -0,0 +1,180 @@
+/*
+ * incremental MIDI byte stream parser
+ *
+ * Turns a byte stream, delivered in chunks of any size, into messages.
+ * The length of a message is looked up from its status byte. Supports
+ * running status, realtime bytes anywhere (also inside other messages
+ * and sysex) and copies sysex bodies in bulk instead of byte by byte.
+ *
+ * The handler is any type with these members, called for each event:
+ *
+ *   void message(const uint8_t *bytes, int size);     complete short message
+ *   void sysex_begin();                                 0xf0 seen
+ *   void sysex_data(const uint8_t *bytes, int size);   next part of the body, the final 0xf7 included
+ *   void sysex_end(bool complete);                      0xf7 seen, or false if another status byte aborted it
+ */
+#ifndef MIDI_PARSER_H
+#define MIDI_PARSER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIDI_SYSEX_START 0xf0
+#define MIDI_SYSEX_END   0xf7
+// first realtime status byte
+#define MIDI_REALTIME    0xf8
+
+// in midi_message_length, marks 0xf0
+#define MIDI_LENGTH_SYSEX 0xff
+
+#define MIDI_LENGTH_ROW(n) n, n, n, n, n, n, n, n, n, n, n, n, n, n, n, n
+
+// message length by status byte, 0 for data bytes
+static const uint8_t midi_message_length[256] = {
+    // data bytes
+    MIDI_LENGTH_ROW(0), MIDI_LENGTH_ROW(0), MIDI_LENGTH_ROW(0), MIDI_LENGTH_ROW(0),
+    MIDI_LENGTH_ROW(0), MIDI_LENGTH_ROW(0), MIDI_LENGTH_ROW(0), MIDI_LENGTH_ROW(0),
+    // note off, note on, poly aftertouch, control change
+    MIDI_LENGTH_ROW(3), MIDI_LENGTH_ROW(3), MIDI_LENGTH_ROW(3), MIDI_LENGTH_ROW(3),
+    // program change, channel aftertouch
+    MIDI_LENGTH_ROW(2), MIDI_LENGTH_ROW(2),
+    // pitch bend
+    MIDI_LENGTH_ROW(3),
+    // sysex, time code, song position, song select, undefined, undefined, tune request, end of sysex
+    MIDI_LENGTH_SYSEX, 2, 3, 2, 1, 1, 1, 1,
+    // realtime
+    1, 1, 1, 1, 1, 1, 1, 1,
+};
+
+#undef MIDI_LENGTH_ROW
+
+typedef struct {
+    // running status, 0 if there is none
+    uint8_t status;
+    // the message being assembled
+    uint8_t bytes[3];
+    uint8_t size;
+    uint8_t length;
+    // inside a sysex
+    bool sysex;
+
+    // statistics
+    unsigned long messages;
+    unsigned long sysex_messages;
+    unsigned long sysex_bytes;
+    // data bytes without a status and incomplete messages
+    unsigned long dropped_bytes;
+} midi_parser_t;
+
+inline void midi_parser_reset(midi_parser_t& parser)
+{
+    memset(&parser, 0, sizeof(parser));
+}
+
+// first status byte in [p, end), or end. Looks at eight bytes at a time.
+inline const uint8_t *midi_find_status(const uint8_t *p, const uint8_t *end)
+{
+    while (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
+        p += 8;
+    }
+
+    while (p < end && !(*p & 0x80)) {
+        p++;
+    }
+
+    return p;
+}
+
+template <typename handler_t>
+inline void midi_parse(midi_parser_t& parser, const uint8_t *buffer, int length, handler_t& handler)
+{
+    const uint8_t *p   = buffer;
+    const uint8_t *end = buffer + length;
+
+    while (p < end) {
+        if (parser.sysex) {
+            const uint8_t *body = p;
+            p = midi_find_status(p, end);
+            if (p > body) {
+                handler.sysex_data(body, p - body);
+                parser.sysex_bytes += p - body;
+            }
+            if (p == end) {
+                break;
+            }
+
+            if (*p >= MIDI_REALTIME) {
+                handler.message(p++, 1);
+                parser.messages++;
+                continue;
+            }
+
+            parser.sysex = false;
+            if (*p == MIDI_SYSEX_END) {
+                handler.sysex_data(p++, 1);
+                parser.sysex_bytes++;
+                parser.sysex_messages++;
+                handler.sysex_end(true);
+            } else {
+                // the status byte starting the next message is parsed below
+                handler.sysex_end(false);
+            }
+            continue;
+        }
+
+        uint8_t byte = *p++;
+
+        if (byte >= MIDI_REALTIME) {
+            handler.message(p - 1, 1);
+            parser.messages++;
+            continue;
+        }
+
+        if (byte & 0x80) {
+            parser.dropped_bytes += parser.size;
+            parser.size = 0;
+
+            if (byte == MIDI_SYSEX_START) {
+                parser.status = 0;
+                parser.sysex  = true;
+                handler.sysex_begin();
+                handler.sysex_data(p - 1, 1);
+                parser.sysex_bytes++;
+                continue;
+            }
+
+            if (byte == MIDI_SYSEX_END) {
+                parser.dropped_bytes++;
+                continue;
+            }
+
+            // system common messages cancel running status
+            parser.status = byte < MIDI_SYSEX_START ? byte : 0;
+            parser.length = midi_message_length[byte];
+            parser.bytes[parser.size++] = byte;
+        } else {
+            if (parser.size == 0) {
+                if (!parser.status) {
+                    parser.dropped_bytes++;
+                    continue;
+                }
+                parser.length = midi_message_length[parser.status];
+                parser.bytes[parser.size++] = parser.status;
+            }
+            parser.bytes[parser.size++] = byte;
+        }
+
+        if (parser.size == parser.length) {
+            handler.message(parser.bytes, parser.size);
+            parser.messages++;
+            parser.size = 0;
+        }
+    }
+}
+
+#endif
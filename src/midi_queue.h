@@ -0,0 +1,402 @@
+/*
+ * the USB to JACK path of one endpoint
+ *
+ * process_incoming() parses USB IN payloads into a lock free queue,
+ * pickup_from_queue() places the queued messages into a port buffer
+ * once per cycle, with the lowest latency or, with fixed_latency, each
+ * exactly one period after it came in. Neither knows about libusb or
+ * JACK: payloads come with their completion time, time is read from the
+ * clock of the queue, and the port buffer is reached through an output
+ * type with the members
+ *
+ *   size_t max_event_size();                          room left in the port buffer
+ *   uint8_t *reserve(uint32_t frame, size_t size);    NULL if there is none
+ *
+ * Backends without periods use drain_queue() instead, which passes every
+ * queued message on right away, to an output type with the member
+ *
+ *   bool send(const uint8_t *bytes, size_t size);     false if it was dropped
+ *
+ * main.cpp runs it on libusb and JACK or ALSA, bench/pipeline_bench.cpp on fakes.
+ * All times are microseconds.
+ */
+#ifndef MIDI_QUEUE_H
+#define MIDI_QUEUE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/atomic.hpp>
+#include <boost/static_assert.hpp>
+
+#include "sysex_arena.h"
+#include "midi_parser.h"
+#include "latency_histogram.h"
+#include "midi_thinning.h"
+
+#define IS_SYSEX(a)      ((a) == 0xf0)
+
+// longest message which is stored inline
+#define MIDI_SHORT_SIZE 3
+
+// plain old data, so that queueing a message never allocates.
+// buffer[0] always holds the status byte, the complete bytes of
+// a sysex message live in the sysex arena of its queue.
+typedef struct {
+    // completion of the USB transfer it came in, and when the parser was done with it
+    uint64_t time;
+    uint64_t parsed;
+    // handle into the sysex arena, only valid for sysex
+    uint32_t sysex;
+    uint32_t size;
+    uint8_t  buffer[MIDI_SHORT_SIZE];
+} midi_message_t;
+
+BOOST_STATIC_ASSERT(sizeof(midi_message_t) <= 32);
+
+inline bool is(midi_message_t& msg, const uint8_t *buf)
+{
+    for (int i = 0; i < 3; i++) {
+        if (msg.buffer[i] != buf[i]) return false;
+    }
+
+    return true;
+}
+
+// each queue has exactly one producer (the USB side of its endpoint)
+// and one consumer (the JACK process callback), so no locking is needed
+#define QUEUE_SIZE 1024
+
+// latency of the events of one endpoint, recorded by the JACK thread
+typedef struct {
+    // USB transfer completion to queued
+    latency_histogram_t parse;
+    // queued to picked up by the JACK thread
+    latency_histogram_t queue;
+    // picked up to the time its frame plays
+    latency_histogram_t delivery;
+    // USB transfer completion to the time its frame plays
+    latency_histogram_t total;
+    // distance of the time its frame plays from one period after USB transfer completion
+    latency_histogram_t timing;
+} latency_stats_t;
+
+typedef struct midi_queue midi_queue_t;
+typedef void (*midi_hook_t)(midi_message_t& msg, midi_queue_t& queue);
+
+struct midi_queue {
+    boost::lockfree::spsc_queue<midi_message_t, boost::lockfree::capacity<QUEUE_SIZE> > events;
+    // messages dropped because the JACK side did not pick them up in time
+    boost::atomic<unsigned long> overflows;
+    sysex_arena_t sysex;
+
+    uint64_t (*clock)();
+    // for the hooks, whoever set up the queue
+    void *owner;
+    // may change a short message, before it is queued and before it is
+    // placed into the port buffer. Either may be NULL. on_parsed drops
+    // a message by setting its size to 0.
+    midi_hook_t on_parsed;
+    midi_hook_t on_delivered;
+
+    // dense controller streams are thinned before they are queued, NULL for none
+    midi_thinning_t *thinning;
+
+    // sysex which does not fit into a port buffer is sent in pieces
+    // over several cycles, instead of being dropped
+    bool sysex_split;
+
+    // every message plays exactly one period after it came in, at its own
+    // frame: what came in after the previous cycle ended waits for the
+    // next one. Otherwise it goes into the current cycle, at the last frame.
+    bool fixed_latency;
+
+    // JACK side: bytes of the first queued sysex already sent, when it is split
+    uint32_t sysex_sent;
+    unsigned long sysex_delivered;
+    // times a sysex had to wait for room in the port buffer
+    unsigned long sysex_carried;
+    // pieces of sysex larger than the port buffer, with sysex_split
+    unsigned long sysex_fragments;
+    // sysex larger than the port buffer, dropped without sysex_split
+    unsigned long sysex_oversize;
+
+    latency_stats_t latency;
+};
+
+inline bool midi_queue_init(midi_queue_t& queue, uint32_t sysex_size, uint64_t (*clock)())
+{
+    queue.clock = clock;
+    return sysex_arena_init(queue.sysex, sysex_size);
+}
+
+inline void midi_queue_free(midi_queue_t& queue)
+{
+    sysex_arena_free(queue.sysex);
+}
+
+inline void enqueue(midi_queue_t& queue, midi_message_t& msg)
+{
+    msg.parsed = queue.clock();
+    if (!queue.events.push(msg)) {
+        queue.overflows++;
+    }
+}
+
+// the parser state of one USB IN endpoint
+typedef struct {
+    midi_parser_t parser;
+    // the last complete short message
+    midi_message_t msg;
+    // the sysex being received, its bytes go straight into the arena of the queue
+    midi_message_t sysex;
+
+    // from the start of the first sysex to the end of the last one
+    uint64_t sysex_first;
+    uint64_t sysex_last;
+} midi_input_t;
+
+// queues what thinning held back, once its window is over or before
+// the next message of its channel
+struct thin_emit_t {
+    midi_queue_t& queue;
+
+    void operator()(const uint8_t *bytes, int size, uint64_t time)
+    {
+        midi_message_t msg;
+        memcpy(msg.buffer, bytes, size);
+        msg.size  = size;
+        msg.time  = time;
+        msg.sysex = 0;
+        enqueue(queue, msg);
+    }
+};
+
+// turns parser events into queued messages
+struct queue_handler_t {
+    midi_input_t& input;
+    midi_queue_t& queue;
+    uint64_t time;
+
+    void message(const uint8_t *bytes, int size)
+    {
+        midi_message_t& msg = input.msg;
+        memcpy(msg.buffer, bytes, size);
+        msg.size = size;
+        msg.time = time;
+        if (queue.on_parsed) {
+            queue.on_parsed(msg, queue);
+            if (!msg.size) {
+                return;
+            }
+        }
+        if (queue.thinning) {
+            thin_emit_t emit = { queue };
+            if (thin_offer(*queue.thinning, msg.buffer, msg.size, time, emit)) {
+                return;
+            }
+        }
+        enqueue(queue, msg);
+    }
+
+    void sysex_begin()
+    {
+        input.sysex.buffer[0] = 0xf0;
+        input.sysex.sysex = sysex_handle(queue.sysex);
+        input.sysex.size  = 0;
+        if (!input.sysex_first) {
+            input.sysex_first = time;
+        }
+    }
+
+    void sysex_data(const uint8_t *bytes, int size)
+    {
+        sysex_append(queue.sysex, bytes, size);
+        input.sysex.size += size;
+    }
+
+    void sysex_end(bool complete)
+    {
+        if (!complete) {
+            sysex_abort(queue.sysex);
+            return;
+        }
+
+        input.sysex.time = time;
+        input.sysex_last = time;
+        if (sysex_commit(queue.sysex)) {
+            enqueue(queue, input.sysex);
+        } else {
+            queue.overflows++;
+        }
+    }
+};
+
+// producer: one USB IN payload, completed at time
+inline void process_incoming(const uint8_t *buffer, int length, uint64_t time, midi_input_t& input, midi_queue_t& queue)
+{
+    queue_handler_t handler = { input, queue, time };
+    midi_parse(input.parser, buffer, length, handler);
+}
+
+// producer: call regularly, at the latest when the returned time (0 for never) has come
+inline uint64_t thin_flush_queue(midi_queue_t& queue, uint64_t now)
+{
+    if (!queue.thinning || !queue.thinning->held_count) {
+        return 0;
+    }
+
+    thin_emit_t emit = { queue };
+    return thin_flush(*queue.thinning, now, emit);
+}
+
+inline void record_latency(latency_stats_t& latency, midi_message_t& msg, uint64_t picked_up, uint64_t plays)
+{
+    latency_record(latency.parse,    (int64_t)(msg.parsed - msg.time));
+    latency_record(latency.queue,    (int64_t)(picked_up - msg.parsed));
+    latency_record(latency.delivery, (int64_t)(plays - picked_up));
+    latency_record(latency.total,    (int64_t)(plays - msg.time));
+}
+
+// how far from one period after it came in a message plays
+inline void record_timing(latency_stats_t& latency, midi_message_t& msg, uint64_t plays, double cycle_period)
+{
+    int64_t off = (int64_t)(plays - msg.time) - (int64_t)cycle_period;
+    latency_record(latency.timing, off < 0 ? -off : off);
+}
+
+// consumer: once per cycle, with the start of the previous cycle and the cycle length
+template <typename output_t>
+void pickup_from_queue(midi_queue_t& queue,
+                       output_t& output,
+                       uint64_t prev_cycle,
+                       double cycle_period,
+                       uint32_t nframes
+                       )
+{
+    uint32_t last_framepos = 0;
+    // what fits into the port buffer as long as it is empty
+    size_t capacity = output.max_event_size();
+    uint64_t picked_up = queue.clock();
+
+    while(queue.events.read_available()) {
+        midi_message_t& msg = queue.events.front();
+        // signed, messages may predate the previous cycle
+        double usec_since_start = (double)(int64_t)(msg.time - prev_cycle);
+        long framepos = (long)((usec_since_start * nframes) / cycle_period);
+        if (queue.fixed_latency && framepos >= (long)nframes) {
+            // its frame is in the next cycle
+            break;
+        }
+        // late, or older than the last one placed, like held values thinning
+        // flushes: frames must not go back, or the port buffer refuses them
+        if (framepos < (long)last_framepos) {
+            framepos = last_framepos;
+        }
+        if (framepos >= (long)nframes) {
+            framepos = nframes - 1;
+        }
+        last_framepos = framepos;
+
+        // the current cycle starts playing one period after the previous one
+        uint64_t plays = prev_cycle + (uint64_t)(cycle_period + framepos * cycle_period / nframes);
+
+        // larger than the whole port buffer, it can only go out in pieces
+        if (IS_SYSEX(msg.buffer[0]) && msg.size > capacity) {
+            if (!queue.sysex_split) {
+                queue.sysex_oversize++;
+                sysex_release(queue.sysex, msg.sysex, msg.size);
+                queue.events.pop();
+                continue;
+            }
+
+            size_t length = msg.size - queue.sysex_sent;
+            size_t room = output.max_event_size();
+            if (length > room) {
+                length = room;
+            }
+            uint8_t *buffer = length ? output.reserve(framepos, length) : NULL;
+            if (!buffer) {
+                queue.sysex_carried++;
+                break;
+            }
+
+            sysex_read(queue.sysex, msg.sysex + queue.sysex_sent, buffer, length);
+            queue.sysex_sent += length;
+            queue.sysex_fragments++;
+            if (queue.sysex_sent < msg.size) {
+                // the rest in the next cycle
+                break;
+            }
+
+            queue.sysex_sent = 0;
+            queue.sysex_delivered++;
+            record_latency(queue.latency, msg, picked_up, plays);
+            record_timing(queue.latency, msg, plays, cycle_period);
+            sysex_release(queue.sysex, msg.sysex, msg.size);
+            queue.events.pop();
+            continue;
+        }
+
+        // no room left in this cycle, keep the message for the next one
+        uint8_t *buffer = output.reserve(framepos, msg.size);
+        if (!buffer) {
+            if (IS_SYSEX(msg.buffer[0])) {
+                queue.sysex_carried++;
+            }
+            break;
+        }
+
+        if (IS_SYSEX(msg.buffer[0])) {
+            sysex_read(queue.sysex, msg.sysex, buffer, msg.size);
+            sysex_release(queue.sysex, msg.sysex, msg.size);
+            queue.sysex_delivered++;
+        } else {
+            if (queue.on_delivered) {
+                queue.on_delivered(msg, queue);
+            }
+            memcpy(buffer, msg.buffer, msg.size);
+        }
+        record_latency(queue.latency, msg, picked_up, plays);
+        record_timing(queue.latency, msg, plays, cycle_period);
+        queue.events.pop();
+    }
+}
+
+// sysex goes to drain_queue() outputs in pieces of this size
+#define DRAIN_SYSEX_CHUNK 256
+
+// consumer without periods: everything queued goes out now
+template <typename output_t>
+void drain_queue(midi_queue_t& queue, output_t& output)
+{
+    uint64_t picked_up = queue.clock();
+
+    while (queue.events.read_available()) {
+        midi_message_t& msg = queue.events.front();
+
+        if (IS_SYSEX(msg.buffer[0])) {
+            uint8_t chunk[DRAIN_SYSEX_CHUNK];
+            for (uint32_t sent = 0; sent < msg.size; ) {
+                uint32_t length = msg.size - sent;
+                if (length > sizeof(chunk)) {
+                    length = sizeof(chunk);
+                }
+                sysex_read(queue.sysex, msg.sysex + sent, chunk, length);
+                output.send(chunk, length);
+                sent += length;
+            }
+            sysex_release(queue.sysex, msg.sysex, msg.size);
+            queue.sysex_delivered++;
+        } else {
+            if (queue.on_delivered) {
+                queue.on_delivered(msg, queue);
+            }
+            output.send(msg.buffer, msg.size);
+        }
+        record_latency(queue.latency, msg, picked_up, queue.clock());
+        queue.events.pop();
+    }
+}
+
+#endif
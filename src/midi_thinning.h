@@ -0,0 +1,231 @@
+/*
+ * thinning of dense controller streams before they are queued
+ *
+ * Channel and poly pressure, control changes and pitch bend can come far
+ * more often than a synth needs them. For each of these types a window
+ * can be set: a value which comes sooner than the window after the last
+ * one passed on for the same channel and controller, and which differs
+ * from it by less than delta, is held back. A newer value replaces it,
+ * and thin_flush() passes it on when the window is over, so the last
+ * value of a sweep always arrives, at most one window late. Notes, sysex,
+ * channel mode messages and everything else pass untouched. Whatever a
+ * channel holds goes out before the next message passed on for it, so a
+ * sustain pedal or a bank select is never overtaken by the note or the
+ * program change after it.
+ *
+ * All state lives in fixed tables, a zeroed thinning holds nothing back.
+ * Producer side only.
+ */
+#ifndef MIDI_THINNING_H
+#define MIDI_THINNING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+enum thin_type_t {
+    THIN_AFTERTOUCH,
+    THIN_POLY_AFTERTOUCH,
+    THIN_CONTROL_CHANGE,
+    THIN_PITCH_BEND,
+    THIN_TYPES
+};
+
+// control changes from here on are channel mode messages, like all notes off
+#define THIN_FIRST_CHANNEL_MODE 120
+
+typedef struct {
+    // usecs, 0 passes every value
+    uint64_t window;
+    // a change at least this large passes at once, 0 for none
+    int delta;
+} thin_rule_t;
+
+typedef struct {
+    uint64_t sent_time;
+    uint64_t held_time;
+    uint16_t sent_value;
+    uint16_t held_value;
+    uint8_t  status;
+    uint8_t  data1;
+    uint8_t  type;
+    bool     sent;
+    bool     held;
+    // in the held list, possibly no longer held
+    bool     listed;
+} thin_slot_t;
+
+// per channel: pressure, 128 poly pressures, 128 controllers, pitch bend
+#define THIN_SLOTS_PER_CHANNEL (1 + 128 + 128 + 1)
+#define THIN_SLOTS             (16 * THIN_SLOTS_PER_CHANNEL)
+
+typedef struct {
+    thin_rule_t rules[THIN_TYPES];
+    thin_slot_t slots[THIN_SLOTS];
+    uint16_t held[THIN_SLOTS];
+    int held_count;
+
+    // statistics
+    unsigned long offered[THIN_TYPES];
+    unsigned long removed[THIN_TYPES];
+} midi_thinning_t;
+
+inline const char *thin_type_name(int type)
+{
+    static const char *names[THIN_TYPES] = { "aftertouch", "poly aftertouch", "control change", "pitch bend" };
+    return names[type];
+}
+
+// the slot of a thinnable message, NULL for anything else
+inline thin_slot_t *thin_slot(midi_thinning_t& thinning, const uint8_t *bytes, int size, int& type, uint16_t& value)
+{
+    uint8_t status = bytes[0];
+    thin_slot_t *channel = &thinning.slots[(status & 0x0f) * THIN_SLOTS_PER_CHANNEL];
+
+    switch (status & 0xf0) {
+    case 0xd0:
+        if (size != 2) return NULL;
+        type  = THIN_AFTERTOUCH;
+        value = bytes[1];
+        return channel;
+    case 0xa0:
+        if (size != 3) return NULL;
+        type  = THIN_POLY_AFTERTOUCH;
+        value = bytes[2];
+        return channel + 1 + bytes[1];
+    case 0xb0:
+        if (size != 3 || bytes[1] >= THIN_FIRST_CHANNEL_MODE) return NULL;
+        type  = THIN_CONTROL_CHANGE;
+        value = bytes[2];
+        return channel + 1 + 128 + bytes[1];
+    case 0xe0:
+        if (size != 3) return NULL;
+        type  = THIN_PITCH_BEND;
+        value = bytes[1] | (bytes[2] << 7);
+        return channel + 1 + 128 + 128;
+    default:
+        return NULL;
+    }
+}
+
+// passes the value held in slot to emit(bytes, size, time), with the time it came in
+template <typename emit_t>
+inline void thin_emit_held(thin_slot_t& slot, uint64_t now, emit_t& emit)
+{
+    uint8_t bytes[3] = { slot.status, slot.data1, (uint8_t)slot.held_value };
+    int size = 3;
+    if (slot.type == THIN_AFTERTOUCH) {
+        bytes[1] = slot.held_value;
+        size = 2;
+    } else if (slot.type == THIN_PITCH_BEND) {
+        bytes[1] = slot.held_value & 0x7f;
+        bytes[2] = slot.held_value >> 7;
+    }
+    emit(bytes, size, slot.held_time);
+
+    slot.sent       = true;
+    slot.sent_time  = now;
+    slot.sent_value = slot.held_value;
+    slot.held       = false;
+}
+
+// passes everything held for the channel of status to emit, before a message of it
+// goes out. The slots stay in the held list, thin_flush() drops them from it.
+template <typename emit_t>
+inline void thin_release_channel(midi_thinning_t& thinning, uint8_t status, uint64_t now, emit_t& emit)
+{
+    if (status < 0x80 || status >= 0xf0) {
+        return;
+    }
+
+    int channel = status & 0x0f;
+    for (int i = 0; i < thinning.held_count; i++) {
+        thin_slot_t& slot = thinning.slots[thinning.held[i]];
+        if (slot.held && thinning.held[i] / THIN_SLOTS_PER_CHANNEL == channel) {
+            thin_emit_held(slot, now, emit);
+        }
+    }
+}
+
+// true if the message is held back instead of being passed on now. Before
+// a message is passed on, whatever its channel holds goes to emit.
+template <typename emit_t>
+inline bool thin_offer(midi_thinning_t& thinning, const uint8_t *bytes, int size, uint64_t time, emit_t& emit)
+{
+    int type;
+    uint16_t value;
+    thin_slot_t *slot = thin_slot(thinning, bytes, size, type, value);
+    if (!slot || !thinning.rules[type].window) {
+        if (thinning.held_count) {
+            thin_release_channel(thinning, bytes[0], time, emit);
+        }
+        return false;
+    }
+
+    thin_rule_t& rule = thinning.rules[type];
+    thinning.offered[type]++;
+
+    if (!slot->sent || time - slot->sent_time >= rule.window ||
+        (rule.delta && abs((int)value - (int)slot->sent_value) >= rule.delta)) {
+        // whatever was held is older than this
+        if (slot->held) {
+            slot->held = false;
+            thinning.removed[type]++;
+        }
+        if (thinning.held_count) {
+            thin_release_channel(thinning, bytes[0], time, emit);
+        }
+        slot->sent       = true;
+        slot->sent_time  = time;
+        slot->sent_value = value;
+        return false;
+    }
+
+    if (slot->held) {
+        thinning.removed[type]++;
+    }
+    if (!slot->listed) {
+        thinning.held[thinning.held_count++] = slot - thinning.slots;
+        slot->listed = true;
+    }
+    slot->held       = true;
+    slot->held_time  = time;
+    slot->held_value = value;
+    slot->status     = bytes[0];
+    slot->data1      = bytes[1];
+    slot->type       = type;
+    return true;
+}
+
+// passes held values whose window is over to emit(bytes, size, time), with the
+// time they came in. Returns when the next held value is due, 0 if none is held.
+template <typename emit_t>
+inline uint64_t thin_flush(midi_thinning_t& thinning, uint64_t now, emit_t& emit)
+{
+    uint64_t next = 0;
+    int kept = 0;
+
+    for (int i = 0; i < thinning.held_count; i++) {
+        thin_slot_t& slot = thinning.slots[thinning.held[i]];
+        if (!slot.held) {
+            slot.listed = false;
+            continue;
+        }
+
+        uint64_t due = slot.sent_time + thinning.rules[slot.type].window;
+        if (now < due) {
+            thinning.held[kept++] = thinning.held[i];
+            if (!next || due < next) {
+                next = due;
+            }
+            continue;
+        }
+
+        thin_emit_held(slot, now, emit);
+        slot.listed = false;
+    }
+
+    thinning.held_count = kept;
+    return next;
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * sounding notes, per channel, with the pitch they were sent at
+ *
+ * A note may be transposed when it starts, and its note off has to go
+ * out at the same pitch, whatever the transposition is by then. The
+ * state lives in a fixed table, so tracking is constant time and never
+ * allocates. A zeroed tracker holds no notes.
+ *
+ * Notes released by note_tracker_flush() stay marked until their key
+ * comes up, so that its note off is dropped instead of passed on as it
+ * is, where it could stop a note sounding at that pitch.
+ */
+#ifndef NOTE_TRACKER_H
+#define NOTE_TRACKER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define NOTE_CHANNELS 16
+#define NOTE_KEYS     128
+
+// in sent, a key still down whose note was flushed
+#define NOTE_FLUSHED  0xff
+// from note_tracker_off(), drop the note off
+#define NOTE_DROP     0xff
+
+typedef struct {
+    // pitch sent + 1 for each key held down, 0 while it is up, or NOTE_FLUSHED
+    uint8_t sent[NOTE_CHANNELS][NOTE_KEYS];
+    // keys held down per channel
+    uint8_t held[NOTE_CHANNELS];
+} note_tracker_t;
+
+inline void note_tracker_reset(note_tracker_t& tracker)
+{
+    memset(&tracker, 0, sizeof(tracker));
+}
+
+// key pressed, and sent as pitch
+inline void note_tracker_on(note_tracker_t& tracker, uint8_t channel, uint8_t key, uint8_t pitch)
+{
+    uint8_t& sent = tracker.sent[channel & 0x0f][key & 0x7f];
+    if (!sent || sent == NOTE_FLUSHED) {
+        tracker.held[channel & 0x0f]++;
+    }
+    sent = pitch + 1;
+}
+
+// key released: the pitch its note on was sent at, the key itself if it was not held,
+// NOTE_DROP if its note was flushed
+inline uint8_t note_tracker_off(note_tracker_t& tracker, uint8_t channel, uint8_t key)
+{
+    uint8_t& sent = tracker.sent[channel & 0x0f][key & 0x7f];
+    if (!sent) {
+        return key;
+    }
+    if (sent == NOTE_FLUSHED) {
+        sent = 0;
+        return NOTE_DROP;
+    }
+
+    uint8_t pitch = sent - 1;
+    sent = 0;
+    tracker.held[channel & 0x0f]--;
+    return pitch;
+}
+
+// all notes off on a channel: forget its notes, the message stops them
+inline void note_tracker_clear_channel(note_tracker_t& tracker, uint8_t channel)
+{
+    channel &= 0x0f;
+    if (tracker.held[channel]) {
+        memset(tracker.sent[channel], 0, sizeof(tracker.sent[channel]));
+        tracker.held[channel] = 0;
+    }
+}
+
+// panic: calls release(channel, pitch) for every sounding note and marks them flushed
+template <typename release_t>
+inline int note_tracker_flush(note_tracker_t& tracker, release_t& release)
+{
+    int released = 0;
+
+    for (int channel = 0; channel < NOTE_CHANNELS; channel++) {
+        if (!tracker.held[channel]) {
+            continue;
+        }
+
+        for (int key = 0; key < NOTE_KEYS; key++) {
+            uint8_t& sent = tracker.sent[channel][key];
+            if (sent && sent != NOTE_FLUSHED) {
+                release(channel, sent - 1);
+                sent = NOTE_FLUSHED;
+                released++;
+            }
+        }
+        tracker.held[channel] = 0;
+    }
+
+    return released;
+}
+
+#endif
@@ -0,0 +1,231 @@
+/*
+ * OSC messages sent on behalf of the JACK process thread
+ *
+ * The process thread only queues small POD commands, a worker thread with
+ * normal priority does the actual sending. Commands queued during the same
+ * JACK cycle go out together in one OSC bundle.
+ */
+#ifndef OSC_SENDER_H
+#define OSC_SENDER_H
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <semaphore.h>
+#include <lo/lo.h>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/atomic.hpp>
+
+#define OSC_QUEUE_SIZE  1024
+#define OSC_BUNDLE_SIZE 64
+#define OSC_MAX_PATH    48
+#define OSC_MAX_ARGS    3
+#define OSC_COALESCE_SLOTS 1024
+
+typedef union {
+    int32_t i;
+    float   f;
+} osc_arg_t;
+
+typedef struct {
+    // JACK cycle the command was queued in
+    unsigned long cycle;
+    char path[OSC_MAX_PATH];
+    // 'i' and 'f' only
+    char types[OSC_MAX_ARGS + 1];
+    osc_arg_t args[OSC_MAX_ARGS];
+} osc_command_t;
+
+typedef struct {
+    lo_address target;
+    boost::lockfree::spsc_queue<osc_command_t, boost::lockfree::capacity<OSC_QUEUE_SIZE> > commands;
+    sem_t wakeup;
+    volatile bool running;
+
+    // producer only
+    unsigned long cycle;
+    bool pending;
+
+    // statistics
+    boost::atomic<unsigned long> overflows;
+    unsigned long messages;
+    unsigned long bundles;
+} osc_sender_t;
+
+inline void osc_sender_init(osc_sender_t& sender, lo_address target)
+{
+    sender.target  = target;
+    sender.running = true;
+    sem_init(&sender.wakeup, 0, 0);
+}
+
+// producer: queue a filled in command, never blocks
+inline bool osc_send_command(osc_sender_t& sender, osc_command_t& command)
+{
+    command.cycle = sender.cycle;
+    if (!sender.commands.push(command)) {
+        sender.overflows++;
+        return false;
+    }
+
+    sender.pending = true;
+    return true;
+}
+
+// producer: same arguments as lo_send(), never blocks
+inline bool osc_send(osc_sender_t& sender, const char *path, const char *types, ...)
+{
+    osc_command_t command;
+    strncpy(command.path, path, OSC_MAX_PATH - 1);
+    command.path[OSC_MAX_PATH - 1] = 0;
+    strncpy(command.types, types, OSC_MAX_ARGS);
+    command.types[OSC_MAX_ARGS] = 0;
+
+    va_list ap;
+    va_start(ap, types);
+    for (int i = 0; command.types[i]; i++) {
+        if (command.types[i] == 'f') {
+            command.args[i].f = va_arg(ap, double);
+        } else {
+            command.args[i].i = va_arg(ap, int);
+        }
+    }
+    va_end(ap);
+
+    return osc_send_command(sender, command);
+}
+
+// producer: end of a JACK cycle, wake the worker if anything was queued
+inline void osc_sender_cycle_done(osc_sender_t& sender)
+{
+    if (sender.pending) {
+        sender.pending = false;
+        sem_post(&sender.wakeup);
+    }
+    sender.cycle++;
+}
+
+// Commands for continuous controls go through a coalescer first: it only
+// keeps the latest command per slot and hands the pending ones to the
+// sender at most every min_interval usecs. Producer side only.
+typedef struct {
+    osc_command_t commands[OSC_COALESCE_SLOTS];
+    bool dirty[OSC_COALESCE_SLOTS];
+    uint16_t dirty_slots[OSC_COALESCE_SLOTS];
+    int dirty_count;
+
+    // 0 flushes on every call of osc_coalescer_flush()
+    uint64_t min_interval;
+    uint64_t last_flush;
+
+    // statistics
+    unsigned long merged;
+    unsigned long flushed;
+} osc_coalescer_t;
+
+inline void osc_coalesce(osc_coalescer_t& coalescer, int slot, osc_command_t& command)
+{
+    if (coalescer.dirty[slot]) {
+        coalescer.merged++;
+    } else {
+        coalescer.dirty[slot] = true;
+        coalescer.dirty_slots[coalescer.dirty_count++] = slot;
+    }
+    coalescer.commands[slot] = command;
+}
+
+// call once per JACK cycle, before osc_sender_cycle_done()
+inline void osc_coalescer_flush(osc_coalescer_t& coalescer, osc_sender_t& sender, uint64_t now)
+{
+    if (!coalescer.dirty_count || now - coalescer.last_flush < coalescer.min_interval) {
+        return;
+    }
+
+    for (int i = 0; i < coalescer.dirty_count; i++) {
+        int slot = coalescer.dirty_slots[i];
+        osc_send_command(sender, coalescer.commands[slot]);
+        coalescer.dirty[slot] = false;
+    }
+    coalescer.flushed   += coalescer.dirty_count;
+    coalescer.dirty_count = 0;
+    coalescer.last_flush  = now;
+}
+
+inline lo_message osc_command_message(osc_command_t& command)
+{
+    lo_message message = lo_message_new();
+    for (int i = 0; command.types[i]; i++) {
+        if (command.types[i] == 'f') {
+            lo_message_add_float(message, command.args[i].f);
+        } else {
+            lo_message_add_int32(message, command.args[i].i);
+        }
+    }
+    return message;
+}
+
+// worker: send the commands of one cycle
+inline void osc_sender_send(osc_sender_t& sender, osc_command_t *commands, int count)
+{
+    if (count == 1) {
+        lo_message message = osc_command_message(commands[0]);
+        lo_send_message(sender.target, commands[0].path, message);
+        lo_message_free(message);
+    } else {
+        lo_bundle bundle = lo_bundle_new(LO_TT_IMMEDIATE);
+        for (int i = 0; i < count; i++) {
+            lo_bundle_add_message(bundle, commands[i].path, osc_command_message(commands[i]));
+        }
+        lo_send_bundle(sender.target, bundle);
+        lo_bundle_free_recursive(bundle);
+        sender.bundles++;
+    }
+    sender.messages += count;
+}
+
+// worker thread, arg points to the osc_sender_t
+inline void *osc_sender_main(void *arg)
+{
+    osc_sender_t& sender = *(osc_sender_t *)arg;
+    osc_command_t batch[OSC_BUNDLE_SIZE];
+
+    while (sender.running) {
+        sem_wait(&sender.wakeup);
+
+        int count = 0;
+        while (sender.commands.read_available()) {
+            osc_command_t& command = sender.commands.front();
+            if (count && (count == OSC_BUNDLE_SIZE || command.cycle != batch[0].cycle)) {
+                osc_sender_send(sender, batch, count);
+                count = 0;
+            }
+            batch[count++] = command;
+            sender.commands.pop();
+        }
+
+        if (count) {
+            osc_sender_send(sender, batch, count);
+        }
+    }
+
+    return NULL;
+}
+
+inline void osc_sender_stop(osc_sender_t& sender)
+{
+    sender.running = false;
+    sem_post(&sender.wakeup);
+}
+
+// once the thread has ended, drops whatever it did not send
+inline void osc_sender_free(osc_sender_t& sender)
+{
+    osc_command_t command;
+    while (sender.commands.pop(command)) {
+    }
+    lo_address_free(sender.target);
+    sender.target = NULL;
+    sem_destroy(&sender.wakeup);
+}
+
+#endif
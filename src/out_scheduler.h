@@ -0,0 +1,136 @@
+/*
+ * events for one USB OUT endpoint, held until the time they should go out
+ *
+ * A frontend with periods gets a whole period of events at once. Instead
+ * of sending them right away, in one burst, it queues each one with the
+ * time its frame plays with out_schedule(), and a sender thread passes
+ * them on with out_send_due() once that time has come, so the spacing
+ * of the events within a period survives. Short messages are stored
+ * inline, longer ones (sysex) in a sysex arena, in the same order.
+ *
+ * Exactly one thread schedules (the JACK thread), exactly one sends,
+ * to an output type with the member
+ *
+ *   bool send(const uint8_t *bytes, size_t size, uint64_t deadline);
+ *
+ * Deadlines of one scheduler must not decrease. All times are microseconds.
+ */
+#ifndef OUT_SCHEDULER_H
+#define OUT_SCHEDULER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/atomic.hpp>
+
+#include "sysex_arena.h"
+#include "midi_queue.h"
+
+typedef struct {
+    // time = deadline, sysex = handle of anything longer than MIDI_SHORT_SIZE
+    boost::lockfree::spsc_queue<midi_message_t, boost::lockfree::capacity<QUEUE_SIZE> > events;
+    sysex_arena_t sysex;
+    // events dropped because the queue or the arena was full
+    boost::atomic<unsigned long> overflows;
+} out_scheduler_t;
+
+inline bool out_scheduler_init(out_scheduler_t& scheduler, uint32_t sysex_size)
+{
+    return sysex_arena_init(scheduler.sysex, sysex_size);
+}
+
+inline void out_scheduler_free(out_scheduler_t& scheduler)
+{
+    sysex_arena_free(scheduler.sysex);
+}
+
+// scheduling thread: false if the event was dropped
+inline bool out_schedule(out_scheduler_t& scheduler, const uint8_t *bytes, size_t size, uint64_t deadline)
+{
+    if (!size) {
+        return true;
+    }
+    if (!scheduler.events.write_available()) {
+        scheduler.overflows++;
+        return false;
+    }
+
+    midi_message_t msg;
+    msg.time   = deadline;
+    msg.parsed = 0;
+    msg.size   = size;
+    msg.sysex  = 0;
+    if (size <= MIDI_SHORT_SIZE) {
+        memcpy(msg.buffer, bytes, size);
+    } else {
+        msg.sysex = sysex_handle(scheduler.sysex);
+        sysex_append(scheduler.sysex, bytes, size);
+        if (!sysex_commit(scheduler.sysex)) {
+            scheduler.overflows++;
+            return false;
+        }
+    }
+
+    scheduler.events.push(msg);
+    return true;
+}
+
+// sending thread: the earliest deadline, 0 if nothing is scheduled
+inline uint64_t out_next_deadline(out_scheduler_t& scheduler)
+{
+    if (!scheduler.events.read_available()) {
+        return 0;
+    }
+    return scheduler.events.front().time;
+}
+
+// sending thread: passes on everything due at now, returns the next
+// deadline, 0 if nothing is left
+template <typename output_t>
+uint64_t out_send_due(out_scheduler_t& scheduler, uint64_t now, output_t& output)
+{
+    while (scheduler.events.read_available()) {
+        midi_message_t& msg = scheduler.events.front();
+        if (msg.time > now) {
+            return msg.time;
+        }
+
+        if (msg.size <= MIDI_SHORT_SIZE) {
+            output.send(msg.buffer, msg.size, msg.time);
+        } else {
+            uint8_t chunk[DRAIN_SYSEX_CHUNK];
+            for (uint32_t sent = 0; sent < msg.size; ) {
+                uint32_t length = msg.size - sent;
+                if (length > sizeof(chunk)) {
+                    length = sizeof(chunk);
+                }
+                sysex_read(scheduler.sysex, msg.sysex + sent, chunk, length);
+                output.send(chunk, length, msg.time);
+                sent += length;
+            }
+            sysex_release(scheduler.sysex, msg.sysex, msg.size);
+        }
+        scheduler.events.pop();
+    }
+
+    return 0;
+}
+
+// sending thread: throws away everything scheduled, returns how many events
+inline unsigned long out_discard(out_scheduler_t& scheduler)
+{
+    unsigned long discarded = 0;
+
+    while (scheduler.events.read_available()) {
+        midi_message_t& msg = scheduler.events.front();
+        if (msg.size > MIDI_SHORT_SIZE) {
+            sysex_release(scheduler.sysex, msg.sysex, msg.size);
+        }
+        scheduler.events.pop();
+        discarded++;
+    }
+
+    return discarded;
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * threads with SCHED_FIFO priority and optional CPU pinning,
+ * which keep statistics about their scheduling latency
+ */
+#ifndef RT_THREAD_H
+#define RT_THREAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+typedef struct {
+    const char *name;
+    // SCHED_FIFO priority, 0 runs the thread with normal priority
+    int priority;
+    // CPU to pin the thread to, -1 for any
+    int cpu;
+    pthread_t thread;
+    bool realtime;
+
+    // scheduling latency in usecs, only written by the thread itself
+    unsigned long wakeups;
+    uint64_t latency_total;
+    uint64_t latency_max;
+} rt_thread_t;
+
+// signals are blocked in the new thread, they are handled by the main thread.
+// falls back to normal scheduling if we are not allowed to run realtime.
+inline bool rt_thread_start(rt_thread_t& rt, void *(*thread_main)(void *), void *arg)
+{
+    sigset_t all_signals, old_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (rt.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(rt.cpu, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    int r = -1;
+    if (rt.priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = rt.priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+        r = pthread_create(&rt.thread, &attr, thread_main, arg);
+        rt.realtime = r == 0;
+        if (r != 0) {
+            fprintf(stderr, "%s thread: cannot use SCHED_FIFO priority %d (%s), running with normal priority\n",
+                    rt.name, rt.priority, strerror(r));
+            pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        }
+    }
+
+    if (r != 0) {
+        r = pthread_create(&rt.thread, &attr, thread_main, arg);
+    }
+
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+    if (r != 0) {
+        fprintf(stderr, "%s thread: cannot start (%s)\n", rt.name, strerror(r));
+        return false;
+    }
+
+    return true;
+}
+
+// usecs of CLOCK_MONOTONIC as an absolute time, for sem_clockwait() and clock_nanosleep()
+inline struct timespec monotonic_timespec(uint64_t usecs)
+{
+    struct timespec ts;
+    ts.tv_sec  = usecs / 1000000;
+    ts.tv_nsec = (usecs % 1000000) * 1000;
+    return ts;
+}
+
+inline void rt_thread_record_latency(rt_thread_t& rt, uint64_t usecs)
+{
+    rt.wakeups++;
+    rt.latency_total += usecs;
+    if (usecs > rt.latency_max) {
+        rt.latency_max = usecs;
+    }
+}
+
+inline void rt_thread_reset_stats(rt_thread_t& rt)
+{
+    rt.wakeups       = 0;
+    rt.latency_total = 0;
+    rt.latency_max   = 0;
+}
+
+inline void rt_thread_print_stats(rt_thread_t& rt)
+{
+    fprintf(stderr, "%s thread (%s %d, cpu %d): %lu wakeups, scheduling latency avg %.1f usecs, max %lu usecs\n",
+            rt.name, rt.realtime ? "SCHED_FIFO" : "SCHED_OTHER", rt.realtime ? rt.priority : 0, rt.cpu,
+            rt.wakeups, rt.wakeups ? (double)rt.latency_total / rt.wakeups : 0.0,
+            (unsigned long)rt.latency_max);
+}
+
+#endif
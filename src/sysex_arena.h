@@ -0,0 +1,134 @@
+/*
+ * preallocated byte ring for the bodies of sysex messages
+ *
+ * Exactly one thread appends (the USB side), exactly one thread reads
+ * (the JACK side).  Positions are free running counters, a message is
+ * addressed by the position of its first byte (its handle).  Bytes of a
+ * message being assembled only become visible to the reader after
+ * sysex_commit(), so an incomplete message can be dropped again with
+ * sysex_abort().  A message which does not fit is discarded as a whole,
+ * so the arena has to hold the largest dump expected (a full Ultranova
+ * bank dump is a few hundred KB).
+ */
+#ifndef SYSEX_ARENA_H
+#define SYSEX_ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <boost/atomic.hpp>
+
+#define SYSEX_ARENA_DEFAULT_SIZE (512 * 1024)
+
+typedef struct {
+    uint8_t *data;
+    // a power of two
+    uint32_t size;
+    // first byte not yet released by the reader
+    boost::atomic<uint32_t> read_pos;
+    // end of the last committed message
+    boost::atomic<uint32_t> write_pos;
+    // end of the message currently being assembled, writer only
+    uint32_t pending_pos;
+    // the pending message ran out of space, writer only
+    bool discard;
+    // most bytes ever in use, writer only
+    uint32_t max_used;
+} sysex_arena_t;
+
+// size is rounded up to a power of two. The memory is touched here,
+// so that the USB thread does not take page faults on it later.
+inline bool sysex_arena_init(sysex_arena_t& arena, uint32_t size)
+{
+    arena.size = 1;
+    while (arena.size < size) {
+        arena.size <<= 1;
+    }
+
+    arena.data = (uint8_t *)malloc(arena.size);
+    if (!arena.data) {
+        return false;
+    }
+    memset(arena.data, 0, arena.size);
+    return true;
+}
+
+inline void sysex_arena_free(sysex_arena_t& arena)
+{
+    free(arena.data);
+    arena.data = NULL;
+}
+
+// writer: handle of the message which is about to be appended
+inline uint32_t sysex_handle(sysex_arena_t& arena)
+{
+    return arena.pending_pos;
+}
+
+// writer: append bytes to the pending message, false if the arena is full
+inline bool sysex_append(sysex_arena_t& arena, const uint8_t *buf, size_t len)
+{
+    if (arena.discard) {
+        return false;
+    }
+
+    uint32_t read_pos = arena.read_pos.load(boost::memory_order_acquire);
+    if (len > arena.size - (arena.pending_pos - read_pos)) {
+        arena.pending_pos = arena.write_pos.load(boost::memory_order_relaxed);
+        arena.discard = true;
+        return false;
+    }
+
+    uint32_t offset = arena.pending_pos & (arena.size - 1);
+    size_t first = arena.size - offset;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(arena.data + offset, buf, first);
+    memcpy(arena.data, buf + first, len - first);
+    arena.pending_pos += len;
+
+    if (arena.pending_pos - read_pos > arena.max_used) {
+        arena.max_used = arena.pending_pos - read_pos;
+    }
+    return true;
+}
+
+// writer: publish the pending message, false if it had to be discarded
+inline bool sysex_commit(sysex_arena_t& arena)
+{
+    if (arena.discard) {
+        arena.discard = false;
+        return false;
+    }
+
+    arena.write_pos.store(arena.pending_pos, boost::memory_order_release);
+    return true;
+}
+
+// writer: throw away the pending message
+inline void sysex_abort(sysex_arena_t& arena)
+{
+    arena.pending_pos = arena.write_pos.load(boost::memory_order_relaxed);
+    arena.discard = false;
+}
+
+// reader: copy len bytes of the message at handle, handle + n addresses its n-th byte
+inline void sysex_read(sysex_arena_t& arena, uint32_t handle, uint8_t *dst, size_t len)
+{
+    uint32_t offset = handle & (arena.size - 1);
+    size_t first = arena.size - offset;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(dst, arena.data + offset, first);
+    memcpy(dst + first, arena.data, len - first);
+}
+
+// reader: hand the message at handle back to the writer
+inline void sysex_release(sysex_arena_t& arena, uint32_t handle, size_t len)
+{
+    arena.read_pos.store(handle + len, boost::memory_order_release);
+}
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ * preallocated OUT transfers for one USB endpoint
+ *
+ * All transfers and their buffers are allocated and filled once at
+ * startup. Senders take a transfer from a lock-free free-list, the
+ * completion callback puts it back, so sending from the JACK process
+ * thread never allocates and the memory used stays bounded.
+ *
+ * Messages can also be batched: consecutive messages are packed into
+ * one transfer until the max packet size of the endpoint is reached.
+ * Only one thread may batch on a pool.
+ */
+#ifndef TRANSFER_POOL_H
+#define TRANSFER_POOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <libusb-1.0/libusb.h>
+#include <boost/lockfree/stack.hpp>
+#include <boost/atomic.hpp>
+
+#define TRANSFER_POOL_SIZE   64
+#define TRANSFER_BUFFER_SIZE 512
+
+typedef struct {
+    struct libusb_transfer *transfers[TRANSFER_POOL_SIZE];
+    uint8_t buffers[TRANSFER_POOL_SIZE][TRANSFER_BUFFER_SIZE];
+    boost::lockfree::stack<struct libusb_transfer *, boost::lockfree::capacity<TRANSFER_POOL_SIZE> > free;
+    // sends which found all transfers in flight
+    boost::atomic<unsigned long> exhausted;
+    boost::atomic<unsigned long> messages;
+    boost::atomic<unsigned long> submitted;
+    // submitted and not handed back by the callback yet
+    boost::atomic<int> in_flight;
+
+    // upper bound for the size of a batch
+    int max_packet_size;
+    // transfer currently being filled by transfer_pool_batch()
+    struct libusb_transfer *batch;
+} transfer_pool_t;
+
+// the callback has to hand the transfer back with transfer_pool_release()
+inline bool transfer_pool_init(transfer_pool_t& pool, libusb_device_handle *devh, int endpoint, libusb_transfer_cb_fn callback)
+{
+    for (int i = 0; i < TRANSFER_POOL_SIZE; i++) {
+        pool.transfers[i] = libusb_alloc_transfer(0);
+        if (!pool.transfers[i]) {
+            return false;
+        }
+
+        libusb_fill_interrupt_transfer(pool.transfers[i], devh, endpoint,
+                                       pool.buffers[i], 0,
+                                       callback, &pool, 0);
+        pool.free.push(pool.transfers[i]);
+    }
+
+    pool.max_packet_size = libusb_get_max_packet_size(libusb_get_device(devh), endpoint);
+    if (pool.max_packet_size <= 0 || pool.max_packet_size > TRANSFER_BUFFER_SIZE) {
+        pool.max_packet_size = TRANSFER_BUFFER_SIZE;
+    }
+    pool.batch = NULL;
+
+    return true;
+}
+
+// only frees the transfers which are not in flight any more
+inline void transfer_pool_free(transfer_pool_t& pool)
+{
+    struct libusb_transfer *transfer;
+    while (pool.free.pop(transfer)) {
+        libusb_free_transfer(transfer);
+    }
+}
+
+inline struct libusb_transfer *transfer_pool_acquire(transfer_pool_t& pool)
+{
+    struct libusb_transfer *transfer;
+    if (!pool.free.pop(transfer)) {
+        pool.exhausted++;
+        return NULL;
+    }
+
+    return transfer;
+}
+
+inline void transfer_pool_release(struct libusb_transfer *transfer)
+{
+    transfer_pool_t *pool = (transfer_pool_t *)transfer->user_data;
+    pool->in_flight--;
+    pool->free.push(transfer);
+}
+
+inline bool transfer_pool_submit(struct libusb_transfer *transfer)
+{
+    transfer_pool_t *pool = (transfer_pool_t *)transfer->user_data;
+    pool->in_flight++;
+    if (libusb_submit_transfer(transfer) < 0) {
+        transfer_pool_release(transfer);
+        return false;
+    }
+
+    pool->submitted++;
+    return true;
+}
+
+// after the device was plugged in again. Nothing may be in flight
+// and nobody may send while the transfers are pointed to the new handle.
+inline void transfer_pool_rebind(transfer_pool_t& pool, libusb_device_handle *devh)
+{
+    for (int i = 0; i < TRANSFER_POOL_SIZE; i++) {
+        if (pool.transfers[i]) {
+            pool.transfers[i]->dev_handle = devh;
+        }
+    }
+}
+
+// copy buf into as many transfers as needed and submit them
+inline bool transfer_pool_send(transfer_pool_t& pool, const uint8_t *buf, size_t len)
+{
+    pool.messages++;
+
+    while (len > 0) {
+        struct libusb_transfer *transfer = transfer_pool_acquire(pool);
+        if (!transfer) {
+            return false;
+        }
+
+        size_t chunk = len > TRANSFER_BUFFER_SIZE ? TRANSFER_BUFFER_SIZE : len;
+        memcpy(transfer->buffer, buf, chunk);
+        transfer->length = chunk;
+
+        if (!transfer_pool_submit(transfer)) {
+            return false;
+        }
+
+        buf += chunk;
+        len -= chunk;
+    }
+
+    return true;
+}
+
+// submit the pending batch
+inline bool transfer_pool_flush(transfer_pool_t& pool)
+{
+    if (!pool.batch) {
+        return true;
+    }
+
+    struct libusb_transfer *transfer = pool.batch;
+    pool.batch = NULL;
+    return transfer_pool_submit(transfer);
+}
+
+// append buf to the pending batch, which is submitted first if buf
+// would not fit into the same packet any more
+inline bool transfer_pool_batch(transfer_pool_t& pool, const uint8_t *buf, size_t len)
+{
+    if (pool.batch && pool.batch->length + len > (size_t)pool.max_packet_size) {
+        transfer_pool_flush(pool);
+    }
+
+    if (len > (size_t)pool.max_packet_size) {
+        // too long for any batch, goes out on its own
+        return transfer_pool_send(pool, buf, len);
+    }
+
+    if (!pool.batch) {
+        pool.batch = transfer_pool_acquire(pool);
+        if (!pool.batch) {
+            return false;
+        }
+        pool.batch->length = 0;
+    }
+
+    memcpy(pool.batch->buffer + pool.batch->length, buf, len);
+    pool.batch->length += len;
+    pool.messages++;
+    return true;
+}
+
+#endif
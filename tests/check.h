@@ -0,0 +1,29 @@
+/*
+ * just enough of a test harness: CHECK() reports every failed condition
+ * and goes on, check_done() is the exit status of a test program
+ */
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int checks, check_failures;
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+
+static inline void check(bool ok, const char *condition, const char *file, int line)
+{
+    checks++;
+    if (!ok) {
+        check_failures++;
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, condition);
+    }
+}
+
+static inline int check_done(const char *name)
+{
+    fprintf(stderr, "%s: %d checks, %d failed\n", name, checks, check_failures);
+    return check_failures ? 1 : 0;
+}
+
+#endif
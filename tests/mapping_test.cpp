@@ -0,0 +1,95 @@
+/*
+ * mapping_load(): the built-in mapping, a mapping file, and lines
+ * too long for the line buffer
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/mapping.h"
+#include "check.h"
+
+// a mapping file with text as its contents, NULL if it could not be written
+const char *write_mapping(const char *text)
+{
+    static char filename[] = "/tmp/mapping_testXXXXXX";
+    strcpy(filename + strlen(filename) - 6, "XXXXXX");
+
+    int fd = mkstemp(filename);
+    if (fd < 0) {
+        return NULL;
+    }
+    FILE *file = fdopen(fd, "w");
+    fputs(text, file);
+    fclose(file);
+    return filename;
+}
+
+void test_builtin()
+{
+    mapping_table_t *table = mapping_load(NULL);
+    CHECK(table != NULL);
+    if (!table) {
+        return;
+    }
+
+    // an encoder, then its OSC message
+    mapping_action_t *action = mapping_first(table, 0xb0, 0x10);
+    CHECK(action && action->type == ACTION_ENCODER);
+    action = action ? mapping_next(table, action) : NULL;
+    CHECK(action && action->type == ACTION_OSC && strcmp(action->path, "/ardour/routes/gainabs") == 0);
+    CHECK(mapping_first(table, 0x90, 60) == NULL);
+
+    mapping_free(table);
+}
+
+void test_file()
+{
+    const char *filename = write_mapping("# comment\n0xb1 0x05 remap 0xb3 0x06\n0xb1 0x05 button\n");
+    CHECK(filename != NULL);
+    if (!filename) {
+        return;
+    }
+
+    mapping_table_t *table = mapping_load(filename);
+    unlink(filename);
+    CHECK(table != NULL);
+    if (!table) {
+        return;
+    }
+
+    mapping_action_t *action = mapping_first(table, 0xb1, 0x05);
+    CHECK(action && action->type == ACTION_REMAP && action->status == 0xb3 && action->data1 == 0x06);
+    action = action ? mapping_next(table, action) : NULL;
+    CHECK(action && action->type == ACTION_BUTTON && !mapping_next(table, action));
+
+    mapping_free(table);
+}
+
+void test_long_line()
+{
+    char text[600];
+    memset(text, ' ', sizeof(text));
+    strcpy(text + 400, "# a comment pushed out of the line buffer\n0xb1 0x05 button\n");
+
+    const char *filename = write_mapping(text);
+    CHECK(filename != NULL);
+    if (!filename) {
+        return;
+    }
+
+    mapping_table_t *table = mapping_load(filename);
+    unlink(filename);
+    CHECK(table == NULL);
+    mapping_free(table);
+}
+
+int main()
+{
+    test_builtin();
+    test_file();
+    test_long_line();
+    return check_done("mapping_test");
+}
@@ -0,0 +1,121 @@
+/*
+ * midi_parse(): message lengths, running status, realtime bytes inside
+ * other messages, and sysex delivered in pieces
+ */
+
+#include <string.h>
+
+#include "../src/midi_parser.h"
+#include "check.h"
+
+// everything the parser reports, as one flat log
+struct log_handler_t {
+    uint8_t messages[64][3];
+    int sizes[64];
+    int count;
+
+    uint8_t sysex[256];
+    int sysex_size;
+    int sysex_begun;
+    int sysex_complete;
+    int sysex_aborted;
+
+    void message(const uint8_t *bytes, int size)
+    {
+        memcpy(messages[count], bytes, size);
+        sizes[count++] = size;
+    }
+    void sysex_begin() { sysex_begun++; sysex_size = 0; }
+    void sysex_data(const uint8_t *bytes, int size)
+    {
+        memcpy(sysex + sysex_size, bytes, size);
+        sysex_size += size;
+    }
+    void sysex_end(bool complete) { complete ? sysex_complete++ : sysex_aborted++; }
+};
+
+void test_running_status()
+{
+    midi_parser_t parser;
+    midi_parser_reset(parser);
+    log_handler_t log;
+    memset(&log, 0, sizeof(log));
+
+    // note on with running status, then channel pressure with running status
+    const uint8_t bytes[] = { 0x90, 60, 100, 62, 0, 0xd3, 10, 20 };
+    midi_parse(parser, bytes, sizeof(bytes), log);
+
+    CHECK(log.count == 4);
+    CHECK(log.sizes[1] == 3 && log.messages[1][0] == 0x90 && log.messages[1][1] == 62 && log.messages[1][2] == 0);
+    CHECK(log.sizes[3] == 2 && log.messages[3][0] == 0xd3 && log.messages[3][1] == 20);
+    CHECK(parser.dropped_bytes == 0);
+}
+
+void test_split_and_realtime()
+{
+    midi_parser_t parser;
+    midi_parser_reset(parser);
+    log_handler_t log;
+    memset(&log, 0, sizeof(log));
+
+    // a control change split over two chunks, with a clock in the middle of it
+    const uint8_t first[]  = { 0xb0, 7 };
+    const uint8_t second[] = { 0xf8, 64 };
+    midi_parse(parser, first, sizeof(first), log);
+    midi_parse(parser, second, sizeof(second), log);
+
+    CHECK(log.count == 2);
+    CHECK(log.sizes[0] == 1 && log.messages[0][0] == 0xf8);
+    CHECK(log.sizes[1] == 3 && log.messages[1][0] == 0xb0 && log.messages[1][1] == 7 && log.messages[1][2] == 64);
+}
+
+void test_stray_data()
+{
+    midi_parser_t parser;
+    midi_parser_reset(parser);
+    log_handler_t log;
+    memset(&log, 0, sizeof(log));
+
+    // no status yet, then a system common message cancels running status
+    const uint8_t bytes[] = { 1, 2, 0x90, 60, 1, 0xf6, 61, 1 };
+    midi_parse(parser, bytes, sizeof(bytes), log);
+
+    CHECK(log.count == 2);
+    CHECK(log.messages[1][0] == 0xf6);
+    CHECK(parser.dropped_bytes == 4);
+}
+
+void test_sysex()
+{
+    midi_parser_t parser;
+    midi_parser_reset(parser);
+    log_handler_t log;
+    memset(&log, 0, sizeof(log));
+
+    const uint8_t first[]  = { 0xf0, 0x00, 0x20, 0x29 };
+    const uint8_t second[] = { 0x01, 0xfe, 0x02, 0xf7, 0x80, 60, 0 };
+    midi_parse(parser, first, sizeof(first), log);
+    midi_parse(parser, second, sizeof(second), log);
+
+    const uint8_t body[] = { 0xf0, 0x00, 0x20, 0x29, 0x01, 0x02, 0xf7 };
+    CHECK(log.sysex_begun == 1 && log.sysex_complete == 1 && log.sysex_aborted == 0);
+    CHECK(log.sysex_size == (int)sizeof(body) && memcmp(log.sysex, body, sizeof(body)) == 0);
+    // active sensing inside the sysex, then the note off after it
+    CHECK(log.count == 2 && log.messages[0][0] == 0xfe && log.messages[1][0] == 0x80);
+    CHECK(parser.sysex_messages == 1);
+
+    // a status byte other than 0xf7 aborts the sysex and starts its own message
+    const uint8_t aborted[] = { 0xf0, 0x01, 0x02, 0x90, 64, 127 };
+    midi_parse(parser, aborted, sizeof(aborted), log);
+    CHECK(log.sysex_aborted == 1);
+    CHECK(log.count == 3 && log.messages[2][0] == 0x90 && log.messages[2][1] == 64);
+}
+
+int main()
+{
+    test_running_status();
+    test_split_and_realtime();
+    test_stray_data();
+    test_sysex();
+    return check_done("midi_parser_test");
+}
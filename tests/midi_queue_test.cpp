@@ -0,0 +1,268 @@
+/*
+ * the sysex arena, the USB to JACK queue with thinning and the out
+ * scheduler, on fakes
+ */
+
+#include <string.h>
+
+#include "../src/out_scheduler.h"
+#include "check.h"
+
+uint64_t fake_now;
+
+uint64_t fake_clock()
+{
+    return fake_now;
+}
+
+// a JACK port buffer
+struct port_buffer_t {
+    uint8_t data[64];
+    size_t used;
+    uint32_t frames[16];
+    uint32_t sizes[16];
+    int count;
+
+    size_t max_event_size() { return sizeof(data) - used; }
+
+    uint8_t *reserve(uint32_t frame, size_t size)
+    {
+        if (size > sizeof(data) - used || count == 16) {
+            return NULL;
+        }
+        uint8_t *buffer = data + used;
+        used += size;
+        frames[count] = frame;
+        sizes[count++] = size;
+        return buffer;
+    }
+};
+
+// a USB OUT endpoint
+struct send_log_t {
+    uint64_t deadlines[16];
+    uint8_t status[16];
+    int count;
+
+    bool send(const uint8_t *bytes, size_t size, uint64_t deadline)
+    {
+        deadlines[count] = deadline;
+        status[count++] = bytes[0];
+        return true;
+    }
+};
+
+void test_arena()
+{
+    static sysex_arena_t arena;
+    CHECK(sysex_arena_init(arena, 12));
+    CHECK(arena.size == 16);
+
+    uint8_t bytes[16], out[16];
+    for (int i = 0; i < 16; i++) {
+        bytes[i] = i;
+    }
+
+    // a committed message can be read back, an aborted one leaves no trace
+    uint32_t first = sysex_handle(arena);
+    CHECK(sysex_append(arena, bytes, 10));
+    CHECK(sysex_commit(arena));
+    sysex_append(arena, bytes, 4);
+    sysex_abort(arena);
+    CHECK(arena.write_pos == first + 10 && sysex_handle(arena) == first + 10);
+    sysex_read(arena, first, out, 10);
+    CHECK(memcmp(out, bytes, 10) == 0);
+
+    // full until the reader releases, then the next message wraps around
+    CHECK(!sysex_append(arena, bytes, 8));
+    CHECK(!sysex_commit(arena));
+    sysex_release(arena, first, 10);
+    uint32_t second = sysex_handle(arena);
+    CHECK(sysex_append(arena, bytes, 5));
+    CHECK(sysex_append(arena, bytes + 5, 5));
+    CHECK(sysex_commit(arena));
+    memset(out, 0, sizeof(out));
+    sysex_read(arena, second, out, 10);
+    CHECK(memcmp(out, bytes, 10) == 0);
+    // the aborted message counts too
+    CHECK(arena.max_used == 14);
+
+    sysex_arena_free(arena);
+}
+
+void test_pickup()
+{
+    static midi_queue_t queue;
+    static midi_input_t input;
+    CHECK(midi_queue_init(queue, 1024, fake_clock));
+
+    // cycles of 1000 usecs and 100 frames, the previous one started at 10000
+    const uint8_t notes[] = { 0x90, 60, 100, 0x80, 60, 0 };
+    process_incoming(notes, 3, 10100, input, queue);
+    process_incoming(notes + 3, 3, 10500, input, queue);
+    const uint8_t sysex[] = { 0xf0, 1, 2, 3, 4, 5, 0xf7 };
+    process_incoming(sysex, sizeof(sysex), 10600, input, queue);
+    CHECK(queue.events.read_available() == 3);
+
+    fake_now = 11000;
+    port_buffer_t port;
+    memset(&port, 0, sizeof(port));
+    pickup_from_queue(queue, port, 10000, 1000, 100);
+
+    CHECK(port.count == 3);
+    CHECK(port.frames[0] == 10 && port.frames[1] == 50 && port.frames[2] == 60);
+    CHECK(port.sizes[2] == sizeof(sysex) && memcmp(port.data + 6, sysex, sizeof(sysex)) == 0);
+    CHECK(queue.sysex_delivered == 1 && queue.sysex.read_pos == queue.sysex.write_pos);
+    CHECK(!queue.events.read_available());
+
+    midi_queue_free(queue);
+}
+
+// an event older than the one before it, like a value thinning held back,
+// goes at the same frame, one from before the cycle at its start
+void test_pickup_order()
+{
+    static midi_queue_t queue;
+    static midi_input_t input;
+    CHECK(midi_queue_init(queue, 1024, fake_clock));
+
+    const uint8_t note[] = { 0x90, 60, 100 };
+    process_incoming(note, 3, 9900, input, queue);
+    process_incoming(note, 3, 10500, input, queue);
+    process_incoming(note, 3, 10300, input, queue);
+
+    fake_now = 11000;
+    port_buffer_t port;
+    memset(&port, 0, sizeof(port));
+    pickup_from_queue(queue, port, 10000, 1000, 100);
+
+    CHECK(port.count == 3);
+    CHECK(port.frames[0] == 0 && port.frames[1] == 50 && port.frames[2] == 50);
+
+    midi_queue_free(queue);
+}
+
+// drops note offs, like a note off for a flushed note
+void drop_note_off(midi_message_t& msg, midi_queue_t& queue)
+{
+    if ((msg.buffer[0] & 0xf0) == 0x80) {
+        msg.size = 0;
+    }
+}
+
+void test_dropped()
+{
+    static midi_queue_t queue;
+    static midi_input_t input;
+    CHECK(midi_queue_init(queue, 1024, fake_clock));
+    queue.on_parsed = drop_note_off;
+
+    const uint8_t notes[] = { 0x90, 60, 100, 0x80, 60, 0, 0x90, 62, 100 };
+    process_incoming(notes, sizeof(notes), 10100, input, queue);
+    CHECK(queue.events.read_available() == 2);
+    CHECK(queue.overflows == 0);
+
+    midi_queue_free(queue);
+}
+
+void test_thinning_order()
+{
+    static midi_queue_t queue;
+    static midi_input_t input;
+    static midi_thinning_t thinning;
+    CHECK(midi_queue_init(queue, 1024, fake_clock));
+    thinning.rules[THIN_CONTROL_CHANGE].window = 5000;
+    queue.thinning = &thinning;
+
+    // the pedal goes down and up within the window, then a note on another
+    // channel and one on its own
+    const uint8_t pedal_down[] = { 0xb0, 64, 127 };
+    const uint8_t pedal_up[]   = { 0xb0, 64, 0 };
+    const uint8_t other[]      = { 0x91, 60, 100 };
+    const uint8_t note[]       = { 0x90, 60, 100 };
+    process_incoming(pedal_down, 3, 10000, input, queue);
+    process_incoming(pedal_up, 3, 11000, input, queue);
+    process_incoming(other, 3, 11500, input, queue);
+    CHECK(queue.events.read_available() == 2 && thinning.held_count == 1);
+    process_incoming(note, 3, 12000, input, queue);
+
+    // the held pedal up went out before the note of its channel, with its own time
+    CHECK(queue.events.read_available() == 4);
+    midi_message_t events[4];
+    for (int i = 0; i < 4 && queue.events.read_available(); i++) {
+        events[i] = queue.events.front();
+        queue.events.pop();
+    }
+    CHECK(events[2].buffer[0] == 0xb0 && events[2].buffer[2] == 0 && events[2].time == 11000);
+    CHECK(events[3].buffer[0] == 0x90);
+
+    // nothing is left for thin_flush()
+    CHECK(thin_flush_queue(queue, 20000) == 0);
+    CHECK(!queue.events.read_available());
+
+    midi_queue_free(queue);
+}
+
+void test_fixed_latency()
+{
+    static midi_queue_t queue;
+    static midi_input_t input;
+    CHECK(midi_queue_init(queue, 1024, fake_clock));
+    queue.fixed_latency = true;
+
+    // one in the previous cycle, one after it ended
+    const uint8_t note[] = { 0x90, 60, 100 };
+    process_incoming(note, 3, 10200, input, queue);
+    process_incoming(note, 3, 11300, input, queue);
+
+    fake_now = 11400;
+    port_buffer_t port;
+    memset(&port, 0, sizeof(port));
+    pickup_from_queue(queue, port, 10000, 1000, 100);
+    CHECK(port.count == 1 && port.frames[0] == 20);
+    CHECK(queue.events.read_available() == 1);
+
+    // the next cycle takes it at its own frame
+    memset(&port, 0, sizeof(port));
+    pickup_from_queue(queue, port, 11000, 1000, 100);
+    CHECK(port.count == 1 && port.frames[0] == 30);
+
+    midi_queue_free(queue);
+}
+
+void test_out_scheduler()
+{
+    static out_scheduler_t scheduler;
+    CHECK(out_scheduler_init(scheduler, 1024));
+
+    const uint8_t note[] = { 0x90, 60, 100 };
+    const uint8_t sysex[] = { 0xf0, 1, 2, 3, 0xf7 };
+    CHECK(out_schedule(scheduler, note, sizeof(note), 100));
+    CHECK(out_schedule(scheduler, sysex, sizeof(sysex), 200));
+    CHECK(out_schedule(scheduler, note, sizeof(note), 300));
+    CHECK(out_next_deadline(scheduler) == 100);
+
+    send_log_t log;
+    memset(&log, 0, sizeof(log));
+    CHECK(out_send_due(scheduler, 50, log) == 100 && log.count == 0);
+    CHECK(out_send_due(scheduler, 250, log) == 300);
+    CHECK(log.count == 2 && log.status[0] == 0x90 && log.status[1] == 0xf0 && log.deadlines[1] == 200);
+    CHECK(scheduler.sysex.read_pos == scheduler.sysex.write_pos);
+
+    CHECK(out_discard(scheduler) == 1);
+    CHECK(out_next_deadline(scheduler) == 0);
+
+    out_scheduler_free(scheduler);
+}
+
+int main()
+{
+    test_arena();
+    test_pickup();
+    test_pickup_order();
+    test_dropped();
+    test_thinning_order();
+    test_fixed_latency();
+    test_out_scheduler();
+    return check_done("midi_queue_test");
+}
@@ -0,0 +1,101 @@
+/*
+ * note_tracker: note offs at the pitch their note on went out at,
+ * all notes off, and panic with the keys still down
+ */
+
+#include "../src/note_tracker.h"
+#include "check.h"
+
+struct release_log_t {
+    int count;
+    uint8_t channels[16];
+    uint8_t pitches[16];
+
+    void operator()(uint8_t channel, uint8_t pitch)
+    {
+        channels[count] = channel;
+        pitches[count++] = pitch;
+    }
+};
+
+void test_transposed()
+{
+    note_tracker_t tracker;
+    note_tracker_reset(tracker);
+
+    // pressed an octave up, released after the octave changed back
+    note_tracker_on(tracker, 0, 60, 72);
+    CHECK(tracker.held[0] == 1);
+    CHECK(note_tracker_off(tracker, 0, 60) == 72);
+    CHECK(tracker.held[0] == 0);
+
+    // a key pressed twice is held once
+    note_tracker_on(tracker, 1, 40, 40);
+    note_tracker_on(tracker, 1, 40, 52);
+    CHECK(tracker.held[1] == 1);
+    CHECK(note_tracker_off(tracker, 1, 40) == 52);
+}
+
+void test_untracked()
+{
+    note_tracker_t tracker;
+    note_tracker_reset(tracker);
+
+    // pressed before the driver started: passed on as it is
+    CHECK(note_tracker_off(tracker, 3, 50) == 50);
+    CHECK(tracker.held[3] == 0);
+}
+
+void test_clear_channel()
+{
+    note_tracker_t tracker;
+    note_tracker_reset(tracker);
+
+    note_tracker_on(tracker, 2, 60, 48);
+    note_tracker_on(tracker, 2, 64, 52);
+    note_tracker_on(tracker, 5, 60, 60);
+    note_tracker_clear_channel(tracker, 2);
+
+    CHECK(tracker.held[2] == 0);
+    CHECK(tracker.held[5] == 1);
+    CHECK(note_tracker_off(tracker, 5, 60) == 60);
+}
+
+void test_flush()
+{
+    note_tracker_t tracker;
+    note_tracker_reset(tracker);
+
+    note_tracker_on(tracker, 0, 60, 72);
+    note_tracker_on(tracker, 9, 36, 36);
+
+    release_log_t log = { 0 };
+    CHECK(note_tracker_flush(tracker, log) == 2);
+    CHECK(log.count == 2);
+    CHECK(log.channels[0] == 0 && log.pitches[0] == 72);
+    CHECK(log.channels[1] == 9 && log.pitches[1] == 36);
+    CHECK(tracker.held[0] == 0 && tracker.held[9] == 0);
+
+    // nothing is left to release
+    release_log_t again = { 0 };
+    CHECK(note_tracker_flush(tracker, again) == 0);
+
+    // the keys still down come up: their note offs are dropped, once
+    CHECK(note_tracker_off(tracker, 0, 60) == NOTE_DROP);
+    CHECK(note_tracker_off(tracker, 0, 60) == 60);
+
+    // pressed again before it came up, it is a note like any other
+    note_tracker_on(tracker, 9, 36, 48);
+    CHECK(tracker.held[9] == 1);
+    CHECK(note_tracker_off(tracker, 9, 36) == 48);
+    CHECK(tracker.held[9] == 0);
+}
+
+int main()
+{
+    test_transposed();
+    test_untracked();
+    test_clear_channel();
+    test_flush();
+    return check_done("note_tracker_test");
+}
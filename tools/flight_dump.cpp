@@ -0,0 +1,160 @@
+/*
+ * flight_dump: print what the flight recorder of ultranova4linux recorded
+ *
+ * usage: flight_dump [--capture] [--device N] [--last SECONDS] [FILE]
+ *
+ * Works on the file of a running driver as well as on the one left
+ * behind, and on FILE.1, the recording of the run before. Times are
+ * seconds since recording started. With --capture the USB MIDI payloads
+ * of one device are written in the capture format of bench/fake_usb.h
+ * instead, to replay an incident with
+ *
+ *   tools/flight_dump --capture > incident.txt
+ *   bench/pipeline_bench --capture incident.txt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/flight_recorder.h"
+
+static const char *kind_names[] = {
+    "?",
+    "usb midi",
+    "usb controller",
+    "to jack midi",
+    "to jack controller",
+    "to usb midi",
+    "to usb controller",
+    "mark",
+};
+
+// a consistent copy of the record written under index, false if it was overwritten
+bool read_record(flight_record_t& record, uint64_t index, flight_record_t& copy)
+{
+    if (record.sequence.load(boost::memory_order_acquire) != index + 1) {
+        return false;
+    }
+
+    copy.time   = record.time;
+    copy.kind   = record.kind;
+    copy.device = record.device;
+    copy.length = record.length;
+    memcpy(copy.data, record.data, FLIGHT_DATA_SIZE);
+
+    boost::atomic_thread_fence(boost::memory_order_acquire);
+    return record.sequence.load(boost::memory_order_relaxed) == index + 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = FLIGHT_DEFAULT_FILE;
+    bool capture = false;
+    int device = 0;
+    double last = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--capture") == 0) {
+            capture = true;
+        } else if (strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+            device = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--last") == 0 && i + 1 < argc) {
+            last = atof(argv[++i]);
+        } else if (argv[i][0] != '-') {
+            filename = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [--capture] [--device N] [--last SECONDS] [FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return 1;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t)sizeof(flight_header_t)) {
+        fprintf(stderr, "%s: not a flight recorder file\n", filename);
+        return 1;
+    }
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(filename);
+        return 1;
+    }
+
+    flight_header_t *header = (flight_header_t *)map;
+    if (memcmp(header->magic, FLIGHT_MAGIC, sizeof(FLIGHT_MAGIC)) ||
+        header->record_size != sizeof(flight_record_t) ||
+        sizeof(flight_header_t) + (uint64_t)header->capacity * sizeof(flight_record_t) > (uint64_t)size) {
+        fprintf(stderr, "%s: not a flight recorder file\n", filename);
+        return 1;
+    }
+    flight_record_t *records = (flight_record_t *)(header + 1);
+    uint64_t mask = header->capacity - 1;
+
+    uint64_t next  = header->next.load(boost::memory_order_acquire);
+    uint64_t first = next > header->capacity ? next - header->capacity : 0;
+
+    // where --last starts, records are in the order they were reserved, about in time order
+    uint64_t newest = 0;
+    flight_record_t record;
+    if (last > 0 && next > first && read_record(records[(next - 1) & mask], next - 1, record)) {
+        newest = record.time;
+    }
+
+    unsigned long shown = 0, lost = 0;
+    uint64_t capture_start = 0;
+    for (uint64_t index = first; index < next; index++) {
+        if (!read_record(records[index & mask], index, record)) {
+            lost++;
+            continue;
+        }
+        // records are only about in time order, one may be newer than newest
+        if (newest && record.time + (uint64_t)(last * 1000000) < newest) {
+            continue;
+        }
+
+        int length = record.length < FLIGHT_DATA_SIZE ? record.length : FLIGHT_DATA_SIZE;
+
+        if (capture) {
+            if (record.kind != FLIGHT_USB_MIDI || record.device != device) {
+                continue;
+            }
+            if (!shown) {
+                capture_start = record.time;
+            }
+            printf("%llu", (unsigned long long)(record.time - capture_start));
+            for (int i = 0; i < length; i++) {
+                printf(" %02x", record.data[i]);
+            }
+            printf("\n");
+            shown++;
+            continue;
+        }
+
+        const char *kind = record.kind <= FLIGHT_MARK ? kind_names[record.kind] : kind_names[0];
+        printf("%12.6f  %d  %-18s", (record.time - header->started) / 1000000.0, record.device, kind);
+        if (record.kind == FLIGHT_MARK) {
+            printf(" %.*s", length, (const char *)record.data);
+        } else {
+            for (int i = 0; i < length; i++) {
+                printf(" %02x", record.data[i]);
+            }
+            if (record.length > length) {
+                printf(" ... (%u bytes)", record.length);
+            }
+        }
+        printf("\n");
+        shown++;
+    }
+
+    fprintf(stderr, "%lu records shown, %llu recorded, %llu overwritten, %lu incomplete\n",
+            shown, (unsigned long long)next, (unsigned long long)first, lost);
+
+    munmap(map, size);
+    return 0;
+}